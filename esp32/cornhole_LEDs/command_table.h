@@ -0,0 +1,110 @@
+// Command key lookup for processCommand(). Plain C++ so esp32/tests can
+// build it on the host.
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+
+// Command dispatch table entry. Commands are "KEY:args"; CMD and SET_ROLE
+// carry a second key segment ("CMD:INFO", "SET_ROLE:PRIMARY"). Handlers get
+// the NUL-terminated argument tail of the caller's buffer, so nothing is copied.
+typedef void (*CommandHandler)(const char *args);
+
+struct CommandEntry {
+  const char *key;
+  CommandHandler handler;
+};
+
+// Every command the sketch dispatches, sorted by strcmp() order. Expanded
+// with the real handlers in cornhole_LEDs.ino and with stubs by the host
+// benchmark, so both search the same keys.
+#define COMMAND_TABLE(X) \
+  X("ACK", cmdAck) \
+  X("B1", cmdBoard1Name) \
+  X("B2", cmdIgnore) \
+  X("BRIGHT", cmdBright) \
+  X("CELEB", cmdCeleb) \
+  X("CMD:BLE", cmdBle) \
+  X("CMD:BOOT", cmdBoot) \
+  X("CMD:CLEAR", cmdClear) \
+  X("CMD:IDENTIFY", cmdIdentify) \
+  X("CMD:INFO", cmdInfo) \
+  X("CMD:LEDBENCH", cmdLedBench) \
+  X("CMD:LINKSTATS", cmdLinkStats) \
+  X("CMD:PERF", cmdPerf) \
+  X("CMD:RELAY", cmdRelay) \
+  X("CMD:RENDER", cmdRender) \
+  X("CMD:RESTART", cmdRestart) \
+  X("CMD:SETTINGS", cmdSettings) \
+  X("CMD:SLEEP", cmdSleep) \
+  X("ColorIndex", cmdColorIndex) \
+  X("DEEPSLEEP", cmdDeepSleep) \
+  X("Effect", cmdEffect) \
+  X("FPS", cmdFps) \
+  X("IC", cmdInitialColor) \
+  X("SC1", cmdSportsColor1) \
+  X("SC2", cmdSportsColor2) \
+  X("SET_ROLE:PRIMARY", cmdSetRolePrimary) \
+  X("SET_ROLE:SECONDARY", cmdSetRoleSecondary) \
+  X("SIZE", cmdSize) \
+  X("SPEED", cmdSpeed) \
+  X("TIMEOUT", cmdTimeout) \
+  X("brightness", cmdBrightnessLive) \
+  X("n2", cmdIgnore) \
+  X("r2", cmdIgnore) \
+  X("toggleEspNow", cmdToggleEspNow) \
+  X("toggleLights", cmdToggleLights)
+
+#define COMMAND_ENTRY(key, handler) { key, handler },
+
+constexpr int keyCompare(const char *a, size_t aLen, const char *b) {
+  for (size_t i = 0; i < aLen; i++) {
+    if (b[i] == '\0') return 1;
+    if (a[i] != b[i]) return (unsigned char)a[i] < (unsigned char)b[i] ? -1 : 1;
+  }
+  return b[aLen] == '\0' ? 0 : -1;
+}
+
+constexpr size_t keyLength(const char *s) {
+  size_t n = 0;
+  while (s[n] != '\0') n++;
+  return n;
+}
+
+constexpr bool commandTableSorted(const CommandEntry *table, size_t count) {
+  for (size_t i = 1; i < count; i++) {
+    const char *prev = table[i - 1].key;
+    if (keyCompare(prev, keyLength(prev), table[i].key) >= 0) return false;
+  }
+  return true;
+}
+
+inline const CommandEntry *findCommand(const CommandEntry *table, size_t count, const char *key, size_t len) {
+  size_t lo = 0, hi = count;
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    int cmp = keyCompare(key, len, table[mid].key);
+    if (cmp == 0) return &table[mid];
+    if (cmp < 0) hi = mid;
+    else lo = mid + 1;
+  }
+  return nullptr;
+}
+
+// Splits "KEY:args" (or "CMD:SUB:args") and returns the handler, with
+// *args pointing just past the key's separator.
+inline const CommandEntry *parseCommand(const CommandEntry *table, size_t count, const char *command, const char **args) {
+  const char *sep = strchr(command, ':');
+  size_t keyLen = sep ? sep - command : strlen(command);
+
+  if ((keyLen == 3 && strncmp(command, "CMD", 3) == 0) || (keyLen == 8 && strncmp(command, "SET_ROLE", 8) == 0)) {
+    if (sep) {
+      const char *sub = strchr(sep + 1, ':');
+      sep = sub;
+      keyLen = sub ? sub - command : strlen(command);
+    }
+  }
+
+  *args = sep ? sep + 1 : command + keyLen;
+  return findCommand(table, count, command, keyLen);
+}
@@ -3,6 +3,17 @@
 //corbholeLEDs.ino
 
 #include <WiFi.h>
+
+// Both strips are clocked out at the same time. The default RMT driver loads
+// every channel and starts them together. The I2S driver sends all pins from
+// one DMA stream with its own double-buffered DMA frames. Build with
+// -DLED_OUTPUT_I2S to pick I2S; CMD:LEDBENCH compares the two.
+#ifdef LED_OUTPUT_I2S
+#define FASTLED_ESP32_I2S true
+#define LED_DRIVER_NAME "I2S"
+#else
+#define LED_DRIVER_NAME "RMT"
+#endif
 #include <FastLED.h>
 #include <LEDEffects.h>
 #include <OneButton.h>
@@ -22,6 +33,20 @@
 #include <Update.h>
 #include <esp_partition.h>
 #include <esp_ota_ops.h>
+#include <esp_app_desc.h>
+#include <esp_image_format.h>
+#include <esp_crc.h>
+#include <esp_rtc_time.h>
+#include <mbedtls/sha256.h>
+#include <rom/miniz.h>
+
+#include <atomic>
+
+#include "command_table.h"
+#include "spsc_byte_ring.h"
+#include "espnow_seq.h"
+#include "role_election.h"
+#include "info_slots.h"
 
 #ifndef ARDUINO_FW_VERSION
 #define ARDUINO_FW_VERSION "1.1.0"
@@ -45,7 +70,49 @@ uint8_t peerMAC[6];
 uint8_t knownPeers[MAX_PEERS][6];
 
 int peerCount = 0;
-bool roleMessageSeen = false;
+
+// Peer table. knownPeers is kept in NVS with what we know about each peer,
+// so a reboot or wake registers every peer with ESP-NOW before any traffic
+// and sendToPeers() can unicast from the first command. lastSeen is an LRU
+// stamp from peerClock rather than a time, so it stays ordered across
+// reboots; when the table is full the least recently seen peer is evicted.
+#define PEER_TABLE_VERSION 1
+#define PEER_TABLE_KEY "peers"
+
+struct PeerMeta {
+  int boardNumber;  // 0 until the peer has sent its board info
+  char name[15];
+  uint32_t lastSeen;
+  uint8_t linkQuality;  // Percent of reliable frames ACKed
+};
+
+// The comms task adds peers while loop() sends to them and saves the
+// table, so knownPeers, peerMeta, peerCount and peerClock are only touched
+// under peerMux. Readers that call into ESP-NOW or Serial work from a copy
+// (copyKnownPeers()) since neither may run inside a critical section.
+PeerMeta peerMeta[MAX_PEERS];
+uint32_t peerClock = 0;
+portMUX_TYPE peerMux = portMUX_INITIALIZER_UNLOCKED;
+std::atomic<bool> peerTableChanged(false);  // Set by the comms task, saved by loop()
+uint8_t evictedPeers[MAX_PEERS][6];  // Evicted since loop() last pruned secondaryBoards, under peerMux
+int evictedCount = 0;
+std::atomic<uint32_t> firstUnicastAckUs(0);  // esp_timer_get_time() of the first ACK since boot
+uint32_t broadcastFallbacks = 0;
+
+// Role election. The saved role is used straight away at boot, and every
+// board broadcasts "ROLE: <role>" then and every ROLE_REANNOUNCE_MS after.
+// The comms task records each claim; loop() settles roles in
+// serviceElection() with the rules in role_election.h. A board that hears a
+// claim from a board that is new, expired or rebooted answers with its own,
+// so newcomers learn the others within one round trip. Claims not renewed
+// within ROLE_CLAIM_TTL_MS are ignored, so a PRIMARY that powers off is
+// replaced.
+RoleClaim roleClaims[MAX_PEERS];
+portMUX_TYPE roleMux = portMUX_INITIALIZER_UNLOCKED;
+unsigned long electionStartTime = 0;
+std::atomic<uint32_t> lastRoleAnnounceMs(0);  // Announced from loop() and the comms task
+uint32_t bootFirstFrameUs = 0;  // esp_timer_get_time() when the LEDs first lit
+uint32_t bootPowerOnToLightMs = 0;  // From power-on, RTC clock; 0 unless a power-on reset
 
 // ---------------------- LED Setup ----------------------
 #define RING_LED_PIN 2
@@ -56,6 +123,9 @@ bool roleMessageSeen = false;
 #define COLOR_ORDER GRB
 #define VOLTS 5
 #define MAX_AMPS 2500
+#define WS2812_US_PER_LED 30  // 24 bits at 1.25 us
+#define WS2812_RESET_US 50
+#define LED_BENCH_RUNS 50
 
 CRGB ringLeds[NUM_LEDS_RING];
 CRGB boardLeds[NUM_LEDS_BOARD];
@@ -70,6 +140,10 @@ OneButton button(BUTTON_PIN, true);
 
 // IR Trigger variables
 bool irTriggered = false;
+bool celebrating = false;
+unsigned long celebrationStartTime = 0;
+bool identifying = false;
+unsigned long identifyStartTime = 0;
 
 // ---------------------- Configurable Variables ----------------------
 Preferences preferences;
@@ -92,6 +166,58 @@ unsigned long lastUserActivityTime = 0;    // real user interaction
 unsigned long lastSystemActivityTime = 0;  // any data received or sent
 bool inactivityHandled = false;
 
+// Deferred actions. Handlers that used to delay() before acting schedule
+// the work with deferAction() and return; loop() runs whatever has come
+// due. Scheduling an action that is already pending moves its due time.
+// btPairing() schedules from the BLE task, so access goes through deferredMux.
+#define DEFERRED_QUEUE_LEN 8
+#define LOOP_STALL_LIMIT_US 1000
+
+typedef void (*DeferredAction)();
+
+struct DeferredTask {
+  bool used;
+  unsigned long dueAt;
+  DeferredAction action;
+};
+
+DeferredTask deferredQueue[DEFERRED_QUEUE_LEN];
+portMUX_TYPE deferredMux = portMUX_INITIALIZER_UNLOCKED;
+bool shutdownPending = false;  // Restart or deep sleep scheduled; commands are ignored
+
+// Main-loop stall tracking, since boot or CMD:PERF:RESET
+uint32_t loopMaxUs = 0;
+uint32_t loopStalls = 0;  // Iterations longer than LOOP_STALL_LIMIT_US
+uint32_t handlerMaxUs = 0;
+const char *handlerMaxKey = "";
+
+// Settings cache: commands update the in-memory variables and mark them
+// dirty; flushSettings() writes them to NVS once the sliders go quiet, and
+// before deep sleep or restart.
+#define SETTINGS_FLUSH_DELAY_MS 3000
+
+enum SettingBit : uint16_t {
+  SETTING_BOARD_NAME = 1 << 0,
+  SETTING_INITIAL_COLOR = 1 << 1,
+  SETTING_SPORTS_COLOR1 = 1 << 2,
+  SETTING_SPORTS_COLOR2 = 1 << 3,
+  SETTING_BRIGHTNESS = 1 << 4,
+  SETTING_BLOCK_SIZE = 1 << 5,
+  SETTING_EFFECT_SPEED = 1 << 6,
+  SETTING_IR_DURATION = 1 << 7,
+  SETTING_INACTIVITY_TIMEOUT = 1 << 8,
+  SETTING_DEEP_SLEEP_TIMEOUT = 1 << 9,
+  SETTING_ROLE = 1 << 10,
+  SETTING_PEERS = 1 << 11,
+};
+
+uint16_t dirtySettings = 0;
+unsigned long lastSettingChange = 0;
+uint32_t settingsWritesRequested = 0;  // NVS writes an eager save would have done
+uint32_t settingsWritesPerformed = 0;
+uint32_t lastFlushMicros = 0;
+uint32_t maxFlushMicros = 0;
+
 // Color Definitions
 #define BURNT_ORANGE CRGB(191, 87, 0)
 CRGB sportsEffectColor1 = CRGB(12, 35, 64);
@@ -119,6 +245,107 @@ LEDEffects ledEffects(
   sportsEffectColor1,
   sportsEffectColor2);
 
+// Render task. Frames are drawn on their own task at a fixed rate. loop() and
+// the command handlers never touch ledEffects directly; they update the
+// globals above and call publishRenderSettings(), and the render task picks
+// up the whole snapshot between frames. One-off LED writes outside the render
+// task (OTA, sleep, benchmark) hold ledMutex.
+#define RENDER_FPS_DEFAULT 60
+#define RENDER_FPS_MIN 1
+#define RENDER_FPS_MAX 120
+#define RENDER_CORE 1
+#define RENDER_STATS_WINDOW_MS 1000
+
+// Static frame elision. LEDEffects calls show() from inside applyEffect(),
+// so the only way to skip a redundant push is to skip the call. Once the
+// pixel + brightness hash has held for RENDER_STATIC_HOLD_MS (or 8 effect
+// steps, whichever is longer), the frame counts as static. Drawing stops
+// until settings change, someone else writes the LEDs, or the keep-alive
+// refresh finds the frame has moved again.
+#define RENDER_STATIC_HOLD_MS 1000
+#define RENDER_KEEPALIVE_MS 2000
+
+// IR celebration overlay. handleIRSensor() only flips render_settings.celebrate
+// on and off; the render task draws celebrationEffect() in place of the current
+// effect, one step per CELEBRATION_STEP_MS, so loop() keeps servicing BLE,
+// ESP-NOW and the button for the whole celebration.
+#define CELEBRATION_STEP_MS 20
+
+// CMD:IDENTIFY flashes both strips white IDENTIFY_FLASHES times. Like the
+// celebration it is a render overlay; a deferred action turns it off.
+#define IDENTIFY_FLASHES 10
+#define IDENTIFY_HALF_PERIOD_MS 100
+
+typedef struct render_settings {
+  int effectIndex;
+  bool lightsOn;
+  int brightness;
+  unsigned long blockSize;
+  unsigned long effectSpeed;
+  CRGB color;
+  CRGB initialColor;
+  CRGB sportsColor1;
+  CRGB sportsColor2;
+  bool celebrate;
+  bool identify;
+  uint32_t identifyStartMs;
+} render_settings;
+
+typedef struct render_stats {
+  uint32_t fpsX10;        // Achieved frame rate over the last window, in tenths
+  uint32_t jitterAvgUs;   // Mean |frame interval - target period|
+  uint32_t jitterMaxUs;
+  uint32_t frameAvgUs;    // Time spent drawing a frame
+  uint32_t frameMaxUs;
+  uint32_t overruns;      // Frames that took longer than the period, since boot
+  uint32_t framesDrawn;   // Since boot
+  uint32_t framesElided;  // Static frames not re-sent, since boot
+  uint32_t framesDark;    // Ticks with lights off or OTA running, since boot
+} render_stats;
+
+portMUX_TYPE renderMux = portMUX_INITIALIZER_UNLOCKED;
+render_settings renderShared;
+uint32_t renderSettingsVersion = 0;
+render_stats renderStats = {};
+volatile int renderFps = RENDER_FPS_DEFAULT;
+SemaphoreHandle_t ledMutex = NULL;
+TaskHandle_t renderTaskHandle = NULL;
+std::atomic<bool> renderForceRedraw(false);
+
+// Frame profiler. The render task times each frame with the CPU cycle
+// counter. LEDEffects pushes both strips from inside applyEffect(), so the
+// show() cost is sampled on its own by re-pushing the frame just drawn every
+// PERF_SHOW_SAMPLE_FRAMES frames. Compute time is the effect time minus the
+// latest show sample. Histogram counts are halved once PERF_HIST_AGE_COUNT
+// samples have accumulated, so they follow recent behaviour.
+#define EFFECT_COUNT (sizeof(effects) / sizeof(effects[0]))
+#define PERF_BUCKETS 10
+#define PERF_SHOW_SAMPLE_FRAMES 64
+#define PERF_HIST_AGE_COUNT 1024
+
+const uint32_t perfBucketLimitsUs[PERF_BUCKETS - 1] = { 100, 250, 500, 1000, 2000, 4000, 8000, 16000, 33000 };
+
+typedef struct perf_histogram {
+  uint32_t count;
+  uint32_t buckets[PERF_BUCKETS];
+  uint64_t totalUs;
+  uint32_t lastUs;
+  uint32_t maxUs;  // Since boot or CMD:PERF:RESET
+} perf_histogram;
+
+perf_histogram perfCompute[EFFECT_COUNT];
+perf_histogram perfShow;
+perf_histogram perfIdle;
+perf_histogram perfCelebration;
+uint32_t perfShowSampleUs = 0;
+
+// Command latency: time from a command reaching the board (BLE write or
+// ESP-NOW receive callback) to its handler returning, split by whether a
+// celebration was running. Both are reported by CMD:PERF.
+perf_histogram perfCommand;
+perf_histogram perfCommandCeleb;
+perf_histogram perfLoop;
+
 // --------------- Bluetooth Setup (only for PRIMARY) --------------
 #define SERVICE_UUID "baf6443e-a714-4114-8612-8fc18d1326f7"
 #define CHARACTERISTIC_UUID "5d650eb7-c41b-44f0-9704-3710f21e1c8e"
@@ -135,18 +362,244 @@ bool deviceConnected = false;
 bool oldDeviceConnected = false;
 uint32_t previousMillisBT = 0;
 const uint32_t intervalBT = 10000;  // 10 seconds
-String rxValueStdStr;
-volatile bool bleDataReceived = false;
-String bleCommandBuffer = "";
+
+#define BLE_RX_RING_SIZE 2048
+#define BLE_COMMAND_MAX_LEN 256
+
+SpscByteRing<BLE_RX_RING_SIZE> bleRxRing;
+char bleCommandLine[BLE_COMMAND_MAX_LEN];
+size_t bleCommandLen = 0;
+bool bleCommandOverflow = false;
+std::atomic<uint32_t> bleRxFirstUs(0);  // micros() of the oldest unhandled write, 0 = none
+uint32_t bleOversizeCommands = 0;
+uint32_t bleReportedDrops = 0;
+
+// BLE notifications. updateBluetoothData() only queues the message; the
+// bleTx task splits it into frames of the negotiated MTU (less the 3-byte
+// ATT header) and waits out GATT congestion between them. A full queue
+// drops the message rather than blocking the caller.
+#define BLE_NOTIFY_QUEUE_LEN 16
+#define BLE_TX_IDLE_MS 50  // bleTx re-checks OTA credits at least this often
+#define BLE_NOTIFY_MAX_LEN 256
+#define BLE_DEFAULT_MTU 23
+#define BLE_ATT_HEADER_LEN 3
+
+typedef struct ble_notify_msg {
+  uint16_t len;
+  char data[BLE_NOTIFY_MAX_LEN];
+} ble_notify_msg;
+
+QueueHandle_t bleNotifyQueue = NULL;
+TaskHandle_t bleTxTaskHandle = NULL;
+std::atomic<uint16_t> bleMtu(BLE_DEFAULT_MTU);
+std::atomic<bool> bleCongested(false);
+std::atomic<uint32_t> bleNotifyDrops(0);
+uint32_t bleTxBytes = 0;     // Since boot, written by the bleTx task
+uint32_t bleTxFrames = 0;
+uint64_t bleTxBusyUs = 0;    // Time spent sending, for bytes/s
+uint32_t bleTxCongestedWaits = 0;
 
 bool espNowEnabled = true;  // ESP-NOW synchronization is enabled by default
 
 // OTA
-bool otaInProgress = false;
+volatile bool otaInProgress = false;
 int totalBytesReceived = 0;
 bool updateStarted = false;
 int firmwareSize = 0;
 
+// OTA chunks are copied out of the BLE callback into a fixed pool and
+// written to flash by the otaWriter task, so a slow flash erase never holds
+// up the BLE stack. The app may only have as many chunks in flight as there
+// are buffers: each freed buffer is a credit, announced as a running total
+// (chunks the app may have sent since BEGIN or RESUME) so a lost
+// notification is made up by the next one.
+#define OTA_POOL_BUFFERS 8
+#define OTA_CHUNK_MAX 512
+#define OTA_CREDIT_BATCH 2      // Freed buffers per credit notification
+#define OTA_END_MARK 0xFF       // Queued after the last chunk to finalize
+#define OTA_RESUME_MARK 0xFE    // Queued by RESUME; the writer re-grants once the chunks ahead of it are in flash
+
+typedef struct ota_chunk {
+  uint16_t len;
+  uint8_t data[OTA_CHUNK_MAX];
+} ota_chunk;
+
+ota_chunk otaPool[OTA_POOL_BUFFERS];
+QueueHandle_t otaFreeQueue = NULL;    // Indexes of idle pool buffers
+QueueHandle_t otaFilledQueue = NULL;  // Indexes in arrival order, written by otaWriter
+TaskHandle_t otaWriterTaskHandle = NULL;
+unsigned long otaStartMs = 0;
+uint64_t otaFlashUs = 0;     // Time spent in Update.write() this session
+uint32_t otaPoolLowWater = 0;  // Fewest idle buffers seen this session
+
+// BEGIN:<size>:<sha256 hex> carries the image digest. The writer hashes
+// each chunk as it goes to flash, so the check at END needs no second pass.
+// A new image stays pending-verify until otaSelfTest() has seen the LEDs,
+// ESP-NOW and (PRIMARY) BLE come up; a failed or missing self-test rolls
+// back to the previous partition on the next boot.
+#define OTA_SHA256_LEN 32
+#define OTA_SELF_TEST_DELAY_MS 5000  // After startRadios(), so a render window has been published
+
+mbedtls_sha256_context otaSha;
+uint8_t otaExpectedSha[OTA_SHA256_LEN];
+
+// A session outlives the BLE link. Reading the OTA characteristic gives
+// OTA:active=1,stream=<n>,offset=<n>,size=<n>,sha=<hex>; where offset counts
+// every byte accepted into the pool (the writer will commit them), and the
+// app picks up with RESUME:<offset>:<sha256 hex>. BEGIN and RESUME each open
+// a new credit stream, so grants are sent as OTA_CREDIT:<stream>,<n>; and a
+// late one from before a disconnect cannot be mistaken for a fresh one.
+// ABORT drops the session; so does OTA_SESSION_TIMEOUT_MS without a chunk,
+// so a vanished phone cannot keep the lights dark and deep sleep blocked.
+#define OTA_SESSION_TIMEOUT_MS 120000
+
+// BEGIN:<size>:<sha>:deflate sends the image as one raw deflate stream.
+// The writer inflates each chunk with the ROM inflater into a 32 KB window
+// that is allocated for the session only; size and SHA-256 still describe
+// the inflated image, while offsets and credits count stream bytes.
+enum OtaEncoding : uint8_t { OTA_RAW, OTA_DEFLATE };
+
+OtaEncoding otaEncoding = OTA_RAW;
+tinfl_decompressor *otaInflator = NULL;
+uint8_t *otaWindow = NULL;  // TINFL_LZ_DICT_SIZE bytes, also the output buffer
+size_t otaWindowOfs = 0;
+tinfl_status otaInflateStatus = TINFL_STATUS_NEEDS_MORE_INPUT;
+
+// BEGIN:<size>:<sha>:<enc>:<base ELF sha> marks the (inflated) stream as a
+// CDP1 patch against the running firmware, identified by the ELF SHA-256
+// in its app description (esp32/tools/make_delta.py prints it). After the
+// "CDP1" magic the patch is a list of ops:
+//   'A' <u32 src> <u32 len> <len diff bytes>   out = running[src + i] + diff[i]
+//   'I' <u32 len> <len bytes>                  out = bytes
+// The applier keeps one op header and a small source buffer, so RAM use
+// does not depend on the image or patch size.
+#define OTA_PATCH_SRC_BUF 256
+
+enum OtaPatchState : uint8_t { PATCH_MAGIC, PATCH_OP, PATCH_ARGS, PATCH_ADD, PATCH_INSERT };
+
+bool otaDelta = false;
+const esp_partition_t *otaPatchBase = NULL;
+OtaPatchState otaPatchState = PATCH_MAGIC;
+uint8_t otaPatchHeader[9];  // Op byte plus up to two little-endian u32
+size_t otaPatchHeaderLen = 0;
+uint32_t otaPatchSrc = 0;
+uint32_t otaPatchRemaining = 0;
+uint8_t otaPatchSrcBuf[OTA_PATCH_SRC_BUF];
+
+volatile uint32_t otaBytesQueued = 0;
+volatile unsigned long otaLastActivityMs = 0;
+
+// The writer grants credits as buffers free up, while BEGIN (BLE task) or a
+// relay (comms task) opens a new stream, so the credit state is only
+// touched under otaCreditMux.
+portMUX_TYPE otaCreditMux = portMUX_INITIALIZER_UNLOCKED;
+volatile uint32_t otaStream = 0;
+uint32_t otaCreditsGranted = 0;
+uint32_t otaCreditsPending = 0;  // Freed buffers not yet announced
+uint32_t otaErrorStream = 0;     // Stream to report OTA_ERROR for, 0 if none
+
+// Relay OTA: CMD:RELAY makes the PRIMARY stream its own running image to
+// the SECONDARY boards over ESP-NOW. Relay frames carry no espnow_header;
+// they start with RELAY_MAGIC, and each data frame holds one chunk with
+// its CRC-32. Chunks go out as broadcast windows. After each window the
+// PRIMARY polls, every board answers with its next missing chunk and a
+// bitmap of the chunks it holds past that. A chunk only one board lacks is
+// repaired by unicast to that board, which the radio acknowledges and
+// retries; one several boards lack is rebroadcast. This repeats until every
+// board has the whole window. A SECONDARY hands chunks to the otaWriter
+// pool in order, so flash writes, hashing and finishOta() are the same as
+// for a BLE update.
+#define RELAY_MAGIC 0xB7
+#define RELAY_CHUNK_LEN 240
+#define RELAY_WINDOW 32                // Chunks per window, one status bit each
+#define RELAY_POLL_MS 40               // Wait for statuses after a poll
+#define RELAY_MAX_SILENT_POLLS 25      // About a second without a status drops a board
+#define RELAY_JOIN_MS 1000             // BEGIN is offered this long
+#define RELAY_RESULT_TIMEOUT_MS 20000  // Covers the SECONDARY's final verify
+#define RELAY_RESTART_DELAY_MS 500     // Lets the RESULT frame go out first
+
+enum RelayType : uint8_t { RELAY_BEGIN = 1, RELAY_DATA, RELAY_POLL, RELAY_END, RELAY_STATUS, RELAY_RESULT };
+
+#pragma pack(1)
+typedef struct relay_begin {
+  uint8_t magic;
+  uint8_t type;
+  uint8_t session;
+  uint32_t size;
+  uint16_t chunks;
+  uint8_t sha[OTA_SHA256_LEN];
+  char version[16];
+} relay_begin;
+
+typedef struct relay_data {
+  uint8_t magic;
+  uint8_t type;
+  uint8_t session;
+  uint16_t chunk;
+  uint32_t crc;
+  uint8_t data[RELAY_CHUNK_LEN];
+} relay_data;
+
+typedef struct relay_poll {  // RELAY_POLL and RELAY_END
+  uint8_t magic;
+  uint8_t type;
+  uint8_t session;
+  uint16_t windowEnd;
+} relay_poll;
+
+typedef struct relay_status {
+  uint8_t magic;
+  uint8_t type;
+  uint8_t session;
+  uint16_t base;  // Next chunk the board needs
+  uint32_t held;  // Bit i = chunk base + i already received
+} relay_status;
+
+typedef struct relay_result {
+  uint8_t magic;
+  uint8_t type;
+  uint8_t session;
+  uint8_t ok;
+} relay_result;
+#pragma pack()
+
+// PRIMARY side. The comms task fills in replies; relayTask reads them.
+struct RelayPeer {
+  uint8_t mac[6];
+  bool live;
+  uint16_t base;
+  uint32_t held;
+  unsigned long statusAt;
+  uint8_t silentPolls;
+  int8_t result;  // -1 pending, 0 failed, 1 updated
+};
+
+RelayPeer relayPeers[MAX_PEERS];
+int relayPeerCount = 0;
+portMUX_TYPE relayMux = portMUX_INITIALIZER_UNLOCKED;
+volatile bool relayRunning = false;
+volatile bool relayJoinOpen = false;
+uint8_t relaySession = 0;
+TaskHandle_t relayTaskHandle = NULL;
+
+// SECONDARY side, owned by the comms task. session, primary and result
+// outlive the relay so a lost RESULT can be sent again.
+struct RelayRx {
+  volatile bool active;
+  volatile int8_t result;  // -1 running or never relayed, 0 failed, 1 updated
+  uint8_t session;
+  uint8_t primary[6];
+  uint16_t chunks;
+  uint16_t base;  // Next chunk for the writer
+  uint32_t held;  // Bit i = chunk base + i waiting in relayWindow
+  bool endSeen;
+  bool endQueued;
+  uint32_t crcErrors;
+};
+
+RelayRx relayRx = { false, -1 };
+uint8_t *relayWindow = NULL;  // RELAY_WINDOW chunks, allocated on the first relay
+
 
 // ---------------  Battery Charger and Monitoring --------------
 #define SDA_PIN 8
@@ -157,13 +610,10 @@ int firmwareSize = 0;
 #define ALERT_PIN 21
 
 // Global declarations
-String setupRole;
-String lastEspNowMessage = "";
 String lastAppMessage = "";
-String espNowDataBuffer = "";
-bool espNowDataReceived = false;
 
-// Structure to receive data
+// Structure to receive data. Boards older than the version field send the
+// struct without it (BOARD_INFO_LEGACY_LEN bytes); their version is unknown.
 #pragma pack(1)
 typedef struct struct_message {
   char device[10];
@@ -171,9 +621,192 @@ typedef struct struct_message {
   uint8_t macAddr[6];
   int batteryLevel;
   int batteryVoltage;
+  char version[16];
 } struct_message;
 #pragma pack()
 
+#define BOARD_INFO_LEGACY_LEN offsetof(struct_message, version)
+
+// Every ESP-NOW frame starts with this header. The session byte is random
+// per boot so a rebooted peer restarts its sequence cleanly; receivers keep
+// a sliding window of recent sequence numbers per sender and drop repeats.
+// Frames without the magic byte come from older firmware and skip dedup.
+#define ESPNOW_MAGIC 0xC7
+
+// Header flags. ACK_REQ frames are answered with a header-only ACK frame
+// carrying the same seq; the sender retransmits until it sees one.
+#define ESPNOW_FLAG_ACK_REQ 0x01
+#define ESPNOW_FLAG_ACK 0x02
+
+#pragma pack(1)
+typedef struct espnow_header {
+  uint8_t magic;
+  uint8_t session;
+  uint8_t flags;
+  uint16_t seq;
+} espnow_header;
+#pragma pack()
+
+#define ESPNOW_MAX_PAYLOAD (ESP_NOW_MAX_DATA_LEN - sizeof(espnow_header))
+
+PeerSeqWindow seqWindows[MAX_PEERS];
+uint8_t espNowSession = 0;
+std::atomic<uint16_t> espNowTxSeq(0);  // Take values with nextSeq(espNowTxSeq)
+uint32_t espNowDuplicatesDropped = 0;
+
+// Reliable delivery: unicast frames wait in espNowTxQueue until the peer
+// ACKs them, and are retransmitted with exponential backoff until
+// ESPNOW_MAX_ATTEMPTS. The queue is touched from loop() and from the
+// comms task (ACKs, send status), so access goes through espNowTxMux.
+#define ESPNOW_TX_QUEUE_LEN 16
+#define ESPNOW_MAX_ATTEMPTS 5
+#define ESPNOW_RETRY_BASE_MS 20
+
+struct PendingFrame {
+  bool used;
+  uint8_t mac[6];
+  uint16_t seq;
+  uint8_t len;
+  uint8_t attempts;
+  unsigned long firstSentAt;
+  unsigned long nextRetryAt;
+  uint8_t payload[ESPNOW_MAX_PAYLOAD];
+};
+
+struct PeerLinkStats {
+  bool used;
+  uint8_t mac[6];
+  uint32_t sent;     // reliable messages queued
+  uint32_t acked;
+  uint32_t retries;
+  uint32_t lost;     // gave up after ESPNOW_MAX_ATTEMPTS
+  uint32_t txFail;   // MAC-layer failures reported to onDataSent
+  uint32_t rttLastMs;
+  uint32_t rttAvgMs;
+};
+
+PendingFrame espNowTxQueue[ESPNOW_TX_QUEUE_LEN];
+PeerLinkStats linkStats[MAX_PEERS];
+portMUX_TYPE espNowTxMux = portMUX_INITIALIZER_UNLOCKED;
+
+// ESP-NOW receive pipeline. onDataRecv and onDataSent run on the Wi-Fi task
+// and only copy the frame or send status into espNowRxQueue. commsTask does
+// the protocol work (dedup, ACKs, peer registration, role negotiation) and
+// passes board messages and commands to loop() through espNowAppQueue.
+#define ESPNOW_RX_QUEUE_LEN 16
+#define ESPNOW_APP_QUEUE_LEN 16
+
+enum EspNowRxKind : uint8_t {
+  ESPNOW_RX_DATA,
+  ESPNOW_RX_SENT_OK,    // onDataSent reports; no data
+  ESPNOW_RX_SENT_FAIL,
+};
+
+typedef struct espnow_rx_frame {
+  uint32_t rxUs;  // micros() in onDataRecv
+  uint8_t kind;
+  uint8_t mac[6];
+  uint8_t len;
+  uint8_t data[ESP_NOW_MAX_DATA_LEN];
+} espnow_rx_frame;
+
+QueueHandle_t espNowRxQueue = NULL;
+QueueHandle_t espNowAppQueue = NULL;
+TaskHandle_t commsTaskHandle = NULL;
+
+volatile uint32_t rxCallbackLastUs = 0;
+volatile uint32_t rxCallbackMaxUs = 0;
+volatile uint32_t rxCallbackTotalUs = 0;
+volatile uint32_t rxCallbackCount = 0;
+volatile uint32_t rxQueueDrops = 0;
+uint32_t appQueueDrops = 0;
+
+// Persisted settings. Stored whole with putBytes() in one of two slots;
+// the valid slot with the highest sequence wins, so a torn write only
+// ever loses the update in flight. Bump SETTINGS_BLOB_VERSION when the
+// layout changes.
+#define SETTINGS_BLOB_VERSION 1
+#define SETTINGS_SLOT_A "settingsA"
+#define SETTINGS_SLOT_B "settingsB"
+
+#pragma pack(1)
+typedef struct settings_blob {
+  uint16_t version;
+  uint32_t sequence;
+  char role[10];
+  char ssid[33];
+  char password[65];
+  char boardName[16];
+  uint8_t initialColor[3];
+  uint8_t sportsColor1[3];
+  uint8_t sportsColor2[3];
+  uint8_t brightness;
+  uint32_t blockSize;
+  uint32_t effectSpeed;
+  int32_t inactivityTimeout;
+  int32_t deepSleepTimeout;
+  uint32_t irTriggerDuration;
+  uint32_t crc;  // CRC-32 of every byte before this field
+} settings_blob;
+#pragma pack()
+
+#pragma pack(1)
+typedef struct stored_peer {
+  uint8_t mac[6];
+  uint8_t boardNumber;
+  char name[15];
+  uint32_t lastSeen;
+  uint8_t linkQuality;
+} stored_peer;
+
+typedef struct peer_table_blob {
+  uint16_t version;
+  uint8_t count;
+  uint32_t peerClock;
+  stored_peer peers[MAX_PEERS];
+  uint32_t crc;  // CRC-32 of every byte before this field
+} peer_table_blob;
+#pragma pack()
+
+// Runtime state kept in RTC slow memory through deep sleep and software
+// restarts. deepSleep() and restartBoard() save it; setup() restores it
+// instead of reading NVS.
+#define RTC_STATE_MAGIC 0x43485731
+
+typedef struct rtc_state {
+  uint32_t magic;
+  settings_blob settings;
+  bool settingsSlotA;
+  peer_table_blob peers;
+  int effectIndex;
+  int colorIndex;
+  uint8_t color[3];
+  uint32_t crc;  // CRC-32 of every byte before this field
+} rtc_state;
+
+RTC_DATA_ATTR rtc_state rtcState;
+std::atomic<bool> radiosReady(false);  // ESP-NOW and BLE are up; set by the radios task
+std::atomic<bool> espNowRestarting(false);  // An espNowInit task is running
+volatile bool powerOnEffectPending = false;  // Cold boot: the render task plays it first
+bool espNowReady = false;  // esp_now_init() succeeded
+bool rtcStateCleared = false;  // CMD:CLEAR ran; the next restart must not restore RTC state
+
+// Boot timeline for CMD:BOOT: esp_timer_get_time() at the end of each phase.
+#define BOOT_PHASES_MAX 12
+
+struct BootPhase {
+  const char *name;
+  uint32_t us;
+};
+
+BootPhase bootPhases[BOOT_PHASES_MAX];
+int bootPhaseCount = 0;
+bool warmBoot = false;
+
+uint32_t settingsSequence = 0;
+bool settingsSlotA = true;  // slot holding the current blob
+uint32_t settingsLoadMicros = 0;
+
 // Create a struct_message called board2
 struct_message board2;
 
@@ -184,11 +817,24 @@ struct BoardInfo {
   uint8_t mac[6];
   int batteryLevel;
   int batteryVoltage;
-  String version;
+  String version;  // Empty when the board did not report one
 };
 
 std::vector<BoardInfo> secondaryBoards;
 
+// CMD:INFO replies are time-slotted instead of sent after a random sleep.
+// The PRIMARY answers in slot 0 and forwards the request with its peer
+// table, and each SECONDARY answers in the slot of its index there (see
+// info_slots.h). The PRIMARY times each refresh until every known peer has
+// answered.
+unsigned long infoRequestAt = 0;
+bool infoRefreshActive = false;
+int infoRepliesExpected = 0;
+int infoRepliesReceived = 0;
+uint32_t lastInfoRefreshMs = 0;
+uint8_t infoReplyMac[6];  // Who sent the CMD:INFO a SECONDARY's slot answers
+int infoSlot = 0;
+
 // Pairing Variables
 CRGB previousColor;
 String previousEffect;
@@ -198,12 +844,58 @@ int previousBrightness;
 
 void setupEspNow();
 void setupBT();
+void stopBleServer();
 void initializePreferences();
+void loadLegacyPreferences();
+bool loadSettingsBlob();
+bool writeSettingsBlob();
+void applySettingsBlob(const settings_blob &blob);
+void fillSettingsBlob(settings_blob &blob);
+void loadPeerTable();
+bool writePeerTable();
+void applyPeerTable(const peer_table_blob &blob);
+void fillPeerTable(peer_table_blob &blob);
+void saveRtcState();
+bool restoreRtcState();
+void setupLeds();
+void setupInputs();
+void startRenderTask();
+void startRadios();
+void radiosTask(void *param);
+void restartEspNow();
+void espNowInitTask(void *param);
+void bootPhase(const char *name);
+void sendBootPhases();
+void registerKnownPeers();
+int findPeerSlot(const uint8_t *mac);
+int copyKnownPeers(uint8_t peers[MAX_PEERS][6]);
+int addKnownPeer(const uint8_t *mac);
+void pruneEvictedPeers();
+void forgetLinkStats(const uint8_t *mac);
 void defaultPreferences();
-void handleBluetoothData(String data);
+void handleBluetoothData();
 void updateBluetoothData(String data);
+void bleTxTask(void *param);
+void bleNotify(const char *data, size_t len);
+void bleGattsEvent(esp_gatts_cb_event_t event, esp_gatt_if_t gattsIf, esp_ble_gatts_cb_param_t *param);
+void sendBleStats();
 void onDataRecv(const esp_now_recv_info *info, const uint8_t *incomingData, int len);
 void onDataSent(const uint8_t *mac_addr, esp_now_send_status_t status);
+void handleSendStatus(const uint8_t *mac, bool delivered);
+void commsTask(void *param);
+void handleEspNowFrame(uint32_t rxUs, const uint8_t *mac, const uint8_t *data, int len);
+void queueAppMessage(uint32_t rxUs, const uint8_t *mac, const uint8_t *data, int len);
+void handleEspNowMessage(const espnow_rx_frame &msg);
+void handleBoardMessage(const struct_message &incoming);
+esp_err_t espNowSend(const uint8_t *mac, const uint8_t *data, size_t len);
+esp_err_t espNowSendFrame(const uint8_t *mac, const uint8_t *data, size_t len, uint16_t seq, uint8_t flags);
+esp_err_t espNowSendReliable(const uint8_t *mac, const uint8_t *data, size_t len, uint16_t seq);
+bool sendToPeers(const uint8_t *data, size_t len);
+void serviceEspNowQueue();
+void sendEspNowAck(const uint8_t *mac, uint16_t seq);
+void handleEspNowAck(const uint8_t *mac, uint16_t seq);
+void sendLinkStats();
+bool isDuplicateFrame(const uint8_t *mac, uint8_t session, uint16_t seq);
 String macToString(const uint8_t *mac);
 void sendSettings();
 void sendBoardInfo();
@@ -222,13 +914,73 @@ int getEffectIndex(String effect);
 void powerOnEffect();
 float readBatteryVoltage();
 int readBatteryLevel();
-void processCommand(String command);
-void resolveRole();
+void processCommand(const String &command);
+void sendRestartCommand();
+void startRoleElection();
+void announceRole();
+void noteRoleClaim(const uint8_t *mac, bool primary, uint8_t session);
+void serviceElection();
 void printPeers();
 void deepSleep();
+void markSettingDirty(uint16_t setting);
+void flushSettings();
+void restartBoard();
 size_t getOtaPartitionSize();
 void otaLog(const String &msg);
+void startOtaWriter();
+void otaWriterTask(void *param);
+void otaOpenCreditStream(uint32_t credits);
+void otaSendCredits();
+void flushOtaCredits();
+void otaRestartCredits();
+bool otaWriteImage(const uint8_t *data, size_t len);
+bool otaInflate(const uint8_t *data, size_t len);
+bool otaEmit(const uint8_t *data, size_t len);
+bool otaApplyPatch(const uint8_t *data, size_t len);
+uint32_t readLe32(const uint8_t *p);
+void freeOtaInflator();
+void failOtaSession();
+void finishOta();
+bool parseSha256Hex(const char *hex, uint8_t *out);
+void otaSelfTest();
+void abortOtaSession();
+bool beginOtaSession();
+void cmdRelay(const char *args);
+void relayTask(void *param);
+esp_err_t relaySend(const uint8_t *mac, const void *frame, size_t len);
+void relaySendChunk(const esp_partition_t *part, uint32_t size, uint16_t chunk, const uint8_t *mac);
+bool relayPoll(uint8_t type, uint16_t windowStart, uint16_t windowEnd, uint32_t *missing, int8_t *lacking);
+int relayCount(bool pendingOnly);
+void handleRelayFrame(const uint8_t *mac, const uint8_t *data, int len);
+void relayNoteReply(const uint8_t *mac, const uint8_t *data, int len);
+void relayRxBegin(const uint8_t *mac, const relay_begin *begin);
+void relayRxData(const relay_data *frame, int len);
+void relayRxPoll(const relay_poll *poll);
+void relayRxFlush();
+void relayRxSendStatus();
+void relayRxSendResult();
+void relayReportResult(bool ok);
+size_t relayChunkLen(uint32_t size, uint16_t chunk);
+bool resumeOtaSession(const char *args);
+void formatOtaStatus(char *data, size_t size);
+void serviceOtaSession();
 const char *getFirmwareVersion();
+void publishRenderSettings();
+void renderTask(void *param);
+void lockLeds();
+void unlockLeds();
+void sendRenderStats();
+void sendPerfStats();
+void runLedBenchmark();
+void resetPerfStats();
+void recordCommandLatency(uint32_t sinceUs);
+bool deferAction(DeferredAction action, unsigned long delayMs);
+void serviceDeferredQueue();
+void scheduleRestart(unsigned long delayMs);
+void scheduleDeepSleep(unsigned long delayMs);
+void sendInfoReply();
+void formatBoardInfo(const BoardInfo &b, char *data, size_t size);
+void endIdentify();
 
 // Callback class for handling BLE connection events
 class MyServerCallbacks : public BLEServerCallbacks {
@@ -240,25 +992,32 @@ class MyServerCallbacks : public BLEServerCallbacks {
 
   void onDisconnect(BLEServer *pServer) {
     deviceConnected = false;
+    bleMtu = BLE_DEFAULT_MTU;
+    bleCongested = false;
+  }
+
+  void onMtuChanged(BLEServer *pServer, esp_ble_gatts_cb_param_t *param) {
+    bleMtu = param->mtu.mtu;
+    Serial.printf("BLE MTU negotiated: %u\n", param->mtu.mtu);
   }
 };
 
 // Callback class for handling incoming BLE data
 class MyCallbacks : public BLECharacteristicCallbacks {
   void onWrite(BLECharacteristic *pCharacteristic) {
-    rxValueStdStr = pCharacteristic->getValue();
-
-    if (rxValueStdStr.length() > 0) {
-      // Protect shared variables with a critical section
-      noInterrupts();  // Disable interrupts
-      bleCommandBuffer += String(rxValueStdStr.c_str());
-      bleDataReceived = true;
-      interrupts();  // Re-enable interrupts
+    size_t length = pCharacteristic->getLength();
+
+    if (length > 0) {
+      // Runs on the BLE task; loop() drains the ring on the other core
+      uint32_t none = 0;
+      bleRxFirstUs.compare_exchange_strong(none, micros() | 1);
+      bleRxRing.push(pCharacteristic->getData(), length);
     }
   }
 };
 
-// Callback class for handling incoming OTA data
+// Callback class for handling incoming OTA data. Runs on the BLE task, so
+// it only copies chunks into the pool; otaWriterTask does the flash work.
 class OTAWriteCallback : public BLECharacteristicCallbacks {
   void onWrite(BLECharacteristic *pCharacteristic) override {
     const uint8_t *data = pCharacteristic->getData();
@@ -266,9 +1025,34 @@ class OTAWriteCallback : public BLECharacteristicCallbacks {
 
     if (length == 0) return;
 
+    char header[192];
+    bool control = length < sizeof(header) && (strncmp((char *)data, "BEGIN:", 6) == 0 || strncmp((char *)data, "RESUME:", 7) == 0 || (length == 5 && memcmp(data, "ABORT", 5) == 0));
+    if (control) {
+      memcpy(header, data, length);
+      header[length] = '\0';
+    }
+
+    if (control && strncmp(header, "RESUME:", 7) == 0) {
+      resumeOtaSession(header + 7);
+      return;
+    }
+
+    if (control && strcmp(header, "ABORT") == 0) {
+      if (otaInProgress) {
+        otaLog("🛑 OTA aborted by app at " + String(otaBytesQueued) + " bytes");
+        abortOtaSession();
+      }
+      return;
+    }
+
     // BEGIN: Receive firmware size
-    if (!otaInProgress && strncmp((char *)data, "BEGIN:", 6) == 0) {
-      firmwareSize = atoi((char *)data + 6);
+    if (control && strncmp(header, "BEGIN:", 6) == 0) {
+      if (otaInProgress) {
+        otaLog("❌ OTA session already open, RESUME or ABORT it first");
+        return;
+      }
+      firmwareSize = atoi(header + 6);
+      const char *digest = strchr(header + 6, ':');
       size_t available = getOtaPartitionSize();
       otaLog("📥 OTA Start: expecting " + String(firmwareSize) + " bytes");
       otaLog("📦 OTA Partition space: " + String(available) + " bytes");
@@ -277,66 +1061,93 @@ class OTAWriteCallback : public BLECharacteristicCallbacks {
         otaLog("❌ Invalid or too large firmware size");
         return;
       }
-
-      otaInProgress = true;
-      totalBytesReceived = 0;
-      FastLED.clear();
-      fill_solid(boardLeds, NUM_LEDS_BOARD, CRGB::Yellow);
-      FastLED.show();
-
-      if (!Update.begin(firmwareSize)) {
-        otaLog("❌ Update.begin() failed");
-        otaInProgress = false;
+      if (digest == NULL || !parseSha256Hex(digest + 1, otaExpectedSha)) {
+        otaLog("❌ BEGIN is missing the image SHA-256");
+        return;
+      }
+      const char *encoding = strchr(digest + 1, ':');
+      const char *base = encoding ? strchr(encoding + 1, ':') : NULL;
+      size_t encodingLen = encoding == NULL ? 0 : base ? base - encoding - 1 : strlen(encoding + 1);
+      if (encoding == NULL || (encodingLen == 3 && strncmp(encoding + 1, "raw", 3) == 0)) {
+        otaEncoding = OTA_RAW;
+      } else if (encodingLen == 7 && strncmp(encoding + 1, "deflate", 7) == 0) {
+        otaEncoding = OTA_DEFLATE;
+      } else {
+        otaLog("❌ Unknown OTA encoding " + String(encoding + 1));
         return;
       }
+      otaDelta = base != NULL;
+      if (otaDelta) {
+        uint8_t baseSha[OTA_SHA256_LEN];
+        if (!parseSha256Hex(base + 1, baseSha) || memcmp(baseSha, esp_app_get_description()->app_elf_sha256, OTA_SHA256_LEN) != 0) {
+          otaLog("❌ Patch base does not match the running firmware");
+          return;
+        }
+        otaPatchBase = esp_ota_get_running_partition();
+        otaPatchState = PATCH_MAGIC;
+        otaPatchHeaderLen = 0;
+      }
 
-      otaLog("✅ Update.begin() successful");
+      if (beginOtaSession()) otaOpenCreditStream(OTA_POOL_BUFFERS);
       return;
     }
 
-    // END: finalize
+    // END: finalize once every chunk ahead of it is in flash. The queue
+    // has room for every buffer plus both marks, so it never waits.
     if (length == 3 && memcmp(data, "END", 3) == 0) {
-      otaInProgress = false;
-      fill_solid(boardLeds, NUM_LEDS_BOARD, CRGB::Green);
-      FastLED.show();
-      delay(500);
-      FastLED.clear(true);
-      otaLog("📦 Firmware write complete (" + String(totalBytesReceived) + " bytes)");
-      otaLog("🔍 Validating firmware...");
-
-      if (Update.end(true)) {
-        otaLog("✅ OTA Success — restarting...");
-        ESP.restart();
-      } else {
-        otaLog("❌ OTA Write failed (validation)");
+      uint8_t mark = OTA_END_MARK;
+      if (!otaInProgress) {
+        otaLog("⚠️ OTA END without a session, ignored");
+      } else if (xQueueSend(otaFilledQueue, &mark, 0) != pdTRUE) {
+        otaLog("❌ OTA END already pending");
       }
       return;
     }
 
-    // CHUNK write
+    // CHUNK: copy into a pool buffer and hand it to the writer
     if (otaInProgress) {
-      size_t written = Update.write((uint8_t *)data, length);
-      if (written != length) {
-        otaLog("❌ Chunk write failed at " + String(totalBytesReceived));
-        Update.abort();
-        otaInProgress = false;
-      } else {
-        totalBytesReceived += written;
-        if (totalBytesReceived % 10240 < length) {  // every ~10KB
-          int percent = (totalBytesReceived * 100) / firmwareSize;
-          otaLog("📶 OTA progress: " + String(percent) + "%");
-        }
+      uint8_t idx;
+      if (length > OTA_CHUNK_MAX) {
+        otaLog("❌ Chunk too large (" + String(length) + " bytes)");
+        abortOtaSession();
+        return;
+      }
+      // A credit is only granted once its buffer is free, so an app that
+      // keeps to its credits never finds the pool empty
+      if (xQueueReceive(otaFreeQueue, &idx, 0) != pdTRUE) {
+        otaLog("❌ OTA overrun: no free buffer (app ignored credits)");
+        abortOtaSession();
+        return;
       }
+      uint32_t idle = uxQueueMessagesWaiting(otaFreeQueue);
+      if (idle < otaPoolLowWater) otaPoolLowWater = idle;
+      otaPool[idx].len = length;
+      memcpy(otaPool[idx].data, data, length);
+      xQueueSend(otaFilledQueue, &idx, 0);  // Never full: holds at most every index
+      otaBytesQueued += length;
+      otaLastActivityMs = millis();
     }
   }
+
+  void onRead(BLECharacteristic *pCharacteristic) override {
+    char data[160];
+    formatOtaStatus(data, sizeof(data));
+    pCharacteristic->setValue(data);
+  }
 };
 
 // ---------------------- Setup ----------------------
+// Lights first: state comes from RTC memory when it survived (deep-sleep
+// wake or software restart), otherwise from NVS; the LEDs show it before
+// ESP-NOW, BLE and SPIFFS start on the radios task. A cold boot's power-on
+// animation plays on the render task.
 void setup() {
+  bootPhase("setup");
   Serial.begin(115200);
-  delay(1000);
 
   esp_sleep_wakeup_cause_t wakeup_reason = esp_sleep_get_wakeup_cause();
+  bool rtcUsable = wakeup_reason == ESP_SLEEP_WAKEUP_EXT1 || wakeup_reason == ESP_SLEEP_WAKEUP_TIMER || esp_reset_reason() == ESP_RST_SW;
+  warmBoot = rtcUsable && restoreRtcState();
 
   switch (wakeup_reason) {
     case ESP_SLEEP_WAKEUP_EXT1:
@@ -352,109 +1163,160 @@ void setup() {
       Serial.printf("📌 Wakeup reason code: %d\n", wakeup_reason);
       break;
   }
-  Serial.println("Starting setup...");
+  Serial.println(warmBoot ? "Warm start from RTC state..." : "Starting setup...");
 
   esp_read_mac(deviceMAC, ESP_MAC_WIFI_STA);
   memcpy(hostMAC, deviceMAC, 6);
+  espNowSession = esp_random();
+  espNowTxSeq.store((uint16_t)esp_random());
 
-  initializePreferences();
+  if (!warmBoot) {
+    initializePreferences();
+    currentColor = initialColor;
+    effectIndex = getEffectIndex("Solid");  // or any default effect
+  }
   defaultPreferences();
+  bootPhase("state");
 
-  setupEspNow();
-  resolveRole();
-
-  Serial.print("📡 This Device MAC: ");
-  Serial.println(macToString(deviceMAC));
-  printPeers();
-
-  Serial.println("Device Role: " + savedRole);
-
-  if (savedRole == "PRIMARY") {
-    setupBT();
+  setupLeds();
+  bootPhase("leds");
+  ledEffects.setColor(currentColor);
+  if (warmBoot) {
+    ledEffects.applyEffect(effects[effectIndex]);
+  } else {
+    fill_solid(ringLeds, NUM_LEDS_RING, deviceRole == PRIMARY ? CRGB::Blue : CRGB::Red);
+    FastLED.show();
+  }
+  bootFirstFrameUs = esp_timer_get_time();
+  bootPhase("first_frame");
+  Serial.printf("⏱️ %s to first frame: %lu ms\n", warmBoot ? "Wake" : "Boot", (unsigned long)(bootFirstFrameUs / 1000));
+  // esp_timer starts with the app; the RTC clock has run since power-on,
+  // so it also counts the ROM and bootloader (only after a power-on reset)
+  if (esp_reset_reason() == ESP_RST_POWERON) {
+    bootPowerOnToLightMs = esp_rtc_get_time_us() / 1000;
+    Serial.printf("⏱️ Power-on to light: %lu ms (target 300)\n", (unsigned long)bootPowerOnToLightMs);
   }
 
-  SPIFFS.begin(true);
-
-  currentColor = initialColor;
+  powerOnEffectPending = !warmBoot;  // Blocks for its animation, so not here
+  setupInputs();
+  startRenderTask();
+  bootPhase("render");
+  xTaskCreatePinnedToCore(radiosTask, "radios", 8192, NULL, 1, NULL, 0);
+  Serial.println("Setup completed; radios starting in the background.");
+}
 
+void setupLeds() {
+  ledMutex = xSemaphoreCreateMutex();
   FastLED.addLeds<LED_TYPE, RING_LED_PIN, COLOR_ORDER>(ringLeds, NUM_LEDS_RING).setCorrection(TypicalLEDStrip);
   FastLED.addLeds<LED_TYPE, BOARD_LED_PIN, COLOR_ORDER>(boardLeds, NUM_LEDS_BOARD).setCorrection(TypicalLEDStrip);
   FastLED.setMaxPowerInVoltsAndMilliamps(VOLTS, MAX_AMPS);
   FastLED.setBrightness(brightness);
-  FastLED.clear();
-  FastLED.show();
+}
 
+void setupInputs() {
   pinMode(SENSOR_PIN, INPUT_PULLUP);
   pinMode(BATTERY_PIN, INPUT);
   button.attachClick(singleClick);
   button.attachDoubleClick(doubleClick);
   button.attachLongPressStop(longPress);
-  ledEffects.powerOnEffect();
-  effectIndex = getEffectIndex("Solid");  // or any default effect
-  ledEffects.applyEffect(effects[effectIndex]);
 
   lastUserActivityTime = millis();
   lastSystemActivityTime = millis();
   inactivityHandled = false;
 
   esp_sleep_enable_ext1_wakeup((1ULL << BUTTON_PIN) | (1ULL << SENSOR_PIN), ESP_EXT1_WAKEUP_ANY_HIGH);
+}
+
+void startRenderTask() {
+  publishRenderSettings();
+  xTaskCreatePinnedToCore(renderTask, "render", 4096, NULL, 2, &renderTaskHandle, RENDER_CORE);
+}
+
+// ESP-NOW, role election, BLE (PRIMARY only) and SPIFFS, on a task of
+// their own so loop() runs from the first frame on.
+void radiosTask(void *param) {
+  startRadios();
+  vTaskDelete(NULL);
+}
+
+void startRadios() {
+  setupEspNow();
+  bootPhase("espnow");
+  startRoleElection();
+
+  Serial.print("📡 This Device MAC: ");
+  Serial.println(macToString(deviceMAC));
+  printPeers();
+
+  Serial.println("Device Role: " + savedRole);
 
   if (savedRole == "PRIMARY") {
-    fill_solid(ringLeds, NUM_LEDS_RING, CRGB::Blue);  // Blue = primary
-    FastLED.show();
-  } else {
-    fill_solid(ringLeds, NUM_LEDS_RING, CRGB::Red);  // Red = secondary
-    FastLED.show();
+    setupBT();
+    bootPhase("ble");
+  }
+
+  SPIFFS.begin(true);
+  bootPhase("spiffs");
+  radiosReady = true;
+  deferAction(otaSelfTest, OTA_SELF_TEST_DELAY_MS);
+}
+
+void bootPhase(const char *name) {
+  if (bootPhaseCount >= BOOT_PHASES_MAX) return;
+  bootPhases[bootPhaseCount].name = name;
+  bootPhases[bootPhaseCount].us = esp_timer_get_time();
+  bootPhaseCount++;
+}
+
+// Microseconds since reset at the end of each boot phase.
+void sendBootPhases() {
+  char data[256];
+  int n = snprintf(data, sizeof(data), "BOOT:warm=%d", warmBoot ? 1 : 0);
+  if (bootPowerOnToLightMs) n += snprintf(data + n, sizeof(data) - n, ",poweron_to_light_ms=%lu", (unsigned long)bootPowerOnToLightMs);
+  for (int i = 0; i < bootPhaseCount && n < (int)sizeof(data); i++) {
+    n += snprintf(data + n, sizeof(data) - n, ",%s=%lu", bootPhases[i].name, (unsigned long)bootPhases[i].us);
   }
-  Serial.println("Setup completed.");
+  if (n < (int)sizeof(data) - 1) strcat(data, ";");
+  Serial.println(data);
+  updateBluetoothData(String(data));
 }
 
 // ---------------------- Loop ----------------------
 void loop() {
+  uint32_t loopStart = micros();
   unsigned long currentMillis = millis();
   button.tick();
   handleIRSensor();
 
   // Process BLE data if new data has been received (PRIMARY only)
-  if (deviceRole == PRIMARY) {
+  if (deviceRole == PRIMARY && radiosReady) {
     if (!deviceConnected && currentMillis - previousMillisBT >= intervalBT) {
       previousMillisBT = currentMillis;
       btPairing();
     } else {
-      if (bleDataReceived) {
-        // Copy the command buffer to a local variable safely
-        noInterrupts();
-        String dataToProcess = bleCommandBuffer;
-        bleCommandBuffer = "";
-        bleDataReceived = false;
-        interrupts();
-
-        // Now process the command outside of the critical section
-        handleBluetoothData(dataToProcess);
+      if (!bleRxRing.empty()) {
+        handleBluetoothData();
       }
     }
   }
 
-  if (otaInProgress && Update.isFinished()) {
-    if (Update.end(true)) {
-      Serial.println("✅ OTA Update completed. Rebooting...");
-      delay(1000);
-      ESP.restart();
-    } else {
-      Serial.println("❌ OTA Update failed");
-    }
-    otaInProgress = false;
-  }
+  serviceEspNowQueue();
+  serviceDeferredQueue();
+  serviceOtaSession();
+  if (radiosReady) serviceElection();
 
-  // Process ESP-NOW data
-  if (espNowDataReceived) {
-    espNowDataReceived = false;        // Reset the flag
-    processCommand(espNowDataBuffer);  // Process the received String data
+  // Process ESP-NOW messages handed over by the comms task
+  espnow_rx_frame espNowMsg;
+  while (espNowAppQueue && xQueueReceive(espNowAppQueue, &espNowMsg, 0) == pdTRUE) {
+    handleEspNowMessage(espNowMsg);
   }
 
-  // Apply effect at defined intervals
-  if (lightsOn) {
-    ledEffects.applyEffect(effects[effectIndex]);
+  if (peerTableChanged.exchange(false)) {
+    pruneEvictedPeers();
+    markSettingDirty(SETTING_PEERS);
+  }
+  if (dirtySettings && currentMillis - lastSettingChange >= SETTINGS_FLUSH_DELAY_MS) {
+    flushSettings();
   }
 
   // Handle OTA updates (PRIMARY only)
@@ -469,56 +1331,60 @@ void loop() {
     inactivityHandled = true;  // ✅ prevent re-execution
   }
 
-  if (!otaInProgress && millis() - lastUserActivityTime > (unsigned long)deepSleepTimeout * 1000UL) {
+  if (!otaInProgress && !shutdownPending && millis() - lastUserActivityTime > (unsigned long)deepSleepTimeout * 1000UL) {
     Serial.println("Deep Sleep timeout reached. Entering deep sleep...");
     Serial.printf("Deep Sleep Timeout: %d\n", deepSleepTimeout);
     sendData("espNow", "toggle", "SLEEP");
-    FastLED.clear(true);  // Clears all LEDs and shows black
-    delay(100);           // Ensure it gets shown before sleeping    delay(100);  // allow message to print
-    deepSleep();
-    return;
+    scheduleDeepSleep(100);
   }
+
+  uint32_t loopUs = micros() - loopStart;
+  perfRecord(perfLoop, loopUs);
+  if (loopUs > loopMaxUs) loopMaxUs = loopUs;
+  if (loopUs > LOOP_STALL_LIMIT_US) loopStalls++;
 }
 
 // ---------------------- Initialization Functions ----------------------
 void initializePreferences() {
+  uint32_t start = micros();
   preferences.begin("cornhole", false);
 
-  if (!preferences.getBool("nvsInit", false)) {
-    Serial.println("📦 First-time setup: initializing preferences");
-    preferences.putString("deviceRole", "PRIMARY");
-
-    preferences.putString("ssid", "CornholeAP");
-    preferences.putString("password", "Funforall");
-    preferences.putString("boardName", "Board 1");
-
-    preferences.putInt("initialColorR", 0);
-    preferences.putInt("initialColorG", 0);
-    preferences.putInt("initialColorB", 255);
-
-    preferences.putInt("sportsColor1R", 191);
-    preferences.putInt("sportsColor1G", 87);
-    preferences.putInt("sportsColor1B", 0);
-
-    preferences.putInt("sportsColor2R", 255);
-    preferences.putInt("sportsColor2G", 255);
-    preferences.putInt("sportsColor2B", 255);
-
-    preferences.putInt("brightness", 50);
-    preferences.putULong("blockSize", 15);
-    preferences.putULong("effectSpeed", 25);
-    preferences.putInt("inactivityTimeout", 30000);
-    preferences.putInt("deepSleepTimeout", 60000);
-    preferences.putULong("irTriggerDuration", 4000);
+  loadPeerTable();
+  if (loadSettingsBlob()) {
+    preferences.end();
+    settingsLoadMicros = micros() - start;
+    Serial.printf("⏱️ Settings loaded from blob in %lu us\n", (unsigned long)settingsLoadMicros);
+    return;
+  }
 
-    preferences.putBool("nvsInit", true);
+  if (preferences.getBool("nvsInit", false)) {
+    loadLegacyPreferences();
+    Serial.printf("📦 Migrating legacy keys to settings blob (read in %lu us)\n",
+                  (unsigned long)(micros() - start));
+  } else {
+    Serial.println("📦 First-time setup: initializing preferences");
+    savedRole = "PRIMARY";
+    ssid = "CornholeAP";
+    password = "Funforall";
+    boardName = "Board 1";
+    initialColor = CRGB(0, 0, 255);
+    sportsEffectColor1 = CRGB(191, 87, 0);
+    sportsEffectColor2 = CRGB(255, 255, 255);
+    brightness = 50;
+    blockSize = 15;
+    effectSpeed = 25;
+    inactivityTimeout = 30000;
+    deepSleepTimeout = 60000;
+    irTriggerDuration = 4000;
   }
+  writeSettingsBlob();
   preferences.end();
+  settingsLoadMicros = micros() - start;
 }
 
-void defaultPreferences() {
-  preferences.begin("cornhole", false);
-
+// Reads the pre-blob per-key layout. Kept only to migrate older boards;
+// the legacy keys are left in place so a downgrade still finds them.
+void loadLegacyPreferences() {
   savedRole = preferences.getString("deviceRole", "PRIMARY");  // Default PRIMARY if not set
 
   ssid = preferences.getString("ssid");
@@ -543,7 +1409,196 @@ void defaultPreferences() {
   inactivityTimeout = preferences.getInt("inactivityTimeout", 600);
   deepSleepTimeout = preferences.getInt("deepSleepTimeout", 900);
   irTriggerDuration = preferences.getULong("irTriggerDuration", 4000);
+}
+
+uint32_t settingsBlobCrc(const settings_blob &blob) {
+  return esp_crc32_le(0, (const uint8_t *)&blob, offsetof(settings_blob, crc));
+}
+
+bool readSettingsSlot(const char *key, settings_blob &blob) {
+  if (preferences.getBytesLength(key) != sizeof(settings_blob)) return false;
+  if (preferences.getBytes(key, &blob, sizeof(settings_blob)) != sizeof(settings_blob)) return false;
+  return blob.version == SETTINGS_BLOB_VERSION && blob.crc == settingsBlobCrc(blob);
+}
+
+// Expects preferences to be open.
+bool loadSettingsBlob() {
+  settings_blob a, b;
+  bool validA = readSettingsSlot(SETTINGS_SLOT_A, a);
+  bool validB = readSettingsSlot(SETTINGS_SLOT_B, b);
+  if (!validA && !validB) return false;
+
+  settingsSlotA = validA && (!validB || (int32_t)(a.sequence - b.sequence) > 0);
+  applySettingsBlob(settingsSlotA ? a : b);
+  return true;
+}
+
+void applySettingsBlob(const settings_blob &blob) {
+  settingsSequence = blob.sequence;
+  savedRole = String(blob.role);
+  ssid = String(blob.ssid);
+  password = String(blob.password);
+  boardName = String(blob.boardName);
+  initialColor = CRGB(blob.initialColor[0], blob.initialColor[1], blob.initialColor[2]);
+  sportsEffectColor1 = CRGB(blob.sportsColor1[0], blob.sportsColor1[1], blob.sportsColor1[2]);
+  sportsEffectColor2 = CRGB(blob.sportsColor2[0], blob.sportsColor2[1], blob.sportsColor2[2]);
+  brightness = blob.brightness;
+  blockSize = blob.blockSize;
+  effectSpeed = blob.effectSpeed;
+  inactivityTimeout = blob.inactivityTimeout;
+  deepSleepTimeout = blob.deepSleepTimeout;
+  irTriggerDuration = blob.irTriggerDuration;
+}
+
+// Expects preferences to be open. Always overwrites the older slot.
+bool writeSettingsBlob() {
+  settings_blob blob;
+  fillSettingsBlob(blob);
+
+  const char *target = settingsSlotA ? SETTINGS_SLOT_B : SETTINGS_SLOT_A;
+  if (preferences.putBytes(target, &blob, sizeof(blob)) != sizeof(blob)) {
+    Serial.println("❌ Failed to write settings blob");
+    return false;
+  }
+  settingsSlotA = !settingsSlotA;
+  settingsSequence = blob.sequence;
+  return true;
+}
+
+void fillSettingsBlob(settings_blob &blob) {
+  memset(&blob, 0, sizeof(blob));
+  blob.version = SETTINGS_BLOB_VERSION;
+  blob.sequence = settingsSequence + 1;
+  strncpy(blob.role, savedRole.c_str(), sizeof(blob.role) - 1);
+  strncpy(blob.ssid, ssid.c_str(), sizeof(blob.ssid) - 1);
+  strncpy(blob.password, password.c_str(), sizeof(blob.password) - 1);
+  strncpy(blob.boardName, boardName.c_str(), sizeof(blob.boardName) - 1);
+  blob.initialColor[0] = initialColor.r;
+  blob.initialColor[1] = initialColor.g;
+  blob.initialColor[2] = initialColor.b;
+  blob.sportsColor1[0] = sportsEffectColor1.r;
+  blob.sportsColor1[1] = sportsEffectColor1.g;
+  blob.sportsColor1[2] = sportsEffectColor1.b;
+  blob.sportsColor2[0] = sportsEffectColor2.r;
+  blob.sportsColor2[1] = sportsEffectColor2.g;
+  blob.sportsColor2[2] = sportsEffectColor2.b;
+  blob.brightness = constrain(brightness, 0, 255);
+  blob.blockSize = blockSize;
+  blob.effectSpeed = effectSpeed;
+  blob.inactivityTimeout = inactivityTimeout;
+  blob.deepSleepTimeout = deepSleepTimeout;
+  blob.irTriggerDuration = irTriggerDuration;
+  blob.crc = settingsBlobCrc(blob);
+}
+
+uint32_t peerTableCrc(const peer_table_blob &blob) {
+  return esp_crc32_le(0, (const uint8_t *)&blob, offsetof(peer_table_blob, crc));
+}
+
+// Expects preferences to be open. Fills knownPeers; registerKnownPeers()
+// hands them to ESP-NOW once it is up.
+void loadPeerTable() {
+  peer_table_blob blob;
+  if (preferences.getBytesLength(PEER_TABLE_KEY) != sizeof(blob)) return;
+  if (preferences.getBytes(PEER_TABLE_KEY, &blob, sizeof(blob)) != sizeof(blob)) return;
+  if (blob.version != PEER_TABLE_VERSION || blob.crc != peerTableCrc(blob)) return;
+
+  applyPeerTable(blob);
+  Serial.printf("🧩 Restored %d peers from NVS\n", peerCount);
+}
+
+// Runs in setup() before the comms task exists, so no lock is needed.
+void applyPeerTable(const peer_table_blob &blob) {
+  peerCount = min((int)blob.count, MAX_PEERS);
+  peerClock = blob.peerClock;
+  for (int i = 0; i < peerCount; i++) {
+    const stored_peer &p = blob.peers[i];
+    memcpy(knownPeers[i], p.mac, 6);
+    peerMeta[i].boardNumber = p.boardNumber;
+    memcpy(peerMeta[i].name, p.name, sizeof(p.name));
+    peerMeta[i].name[sizeof(p.name) - 1] = '\0';
+    peerMeta[i].lastSeen = p.lastSeen;
+    peerMeta[i].linkQuality = p.linkQuality;
+
+    if (p.boardNumber > 0) {
+      BoardInfo board;
+      board.boardNumber = p.boardNumber;
+      board.role = "SECONDARY";
+      board.name = String(peerMeta[i].name);
+      memcpy(board.mac, p.mac, 6);
+      board.batteryLevel = 0;
+      board.batteryVoltage = 0;
+      board.version = "";  // Unknown until the board answers CMD:INFO
+      secondaryBoards.push_back(board);
+    }
+  }
+}
+
+// Expects preferences to be open.
+bool writePeerTable() {
+  peer_table_blob blob;
+  fillPeerTable(blob);
+
+  if (preferences.putBytes(PEER_TABLE_KEY, &blob, sizeof(blob)) != sizeof(blob)) {
+    Serial.println("❌ Failed to write peer table");
+    return false;
+  }
+  return true;
+}
+
+void fillPeerTable(peer_table_blob &blob) {
+  memset(&blob, 0, sizeof(blob));
+  blob.version = PEER_TABLE_VERSION;
+  portENTER_CRITICAL(&peerMux);
+  blob.count = peerCount;
+  blob.peerClock = peerClock;
+  for (int i = 0; i < peerCount; i++) {
+    stored_peer &p = blob.peers[i];
+    memcpy(p.mac, knownPeers[i], 6);
+    p.boardNumber = constrain(peerMeta[i].boardNumber, 0, 255);
+    memcpy(p.name, peerMeta[i].name, sizeof(p.name));
+    p.lastSeen = peerMeta[i].lastSeen;
+    p.linkQuality = peerMeta[i].linkQuality;
+  }
+  portEXIT_CRITICAL(&peerMux);
+  blob.crc = peerTableCrc(blob);
+}
+
+// ---------------------- Fast Wake ----------------------
+uint32_t rtcStateCrc(const rtc_state &state) {
+  return esp_crc32_le(0, (const uint8_t *)&state, offsetof(rtc_state, crc));
+}
+
+void saveRtcState() {
+  rtcState.magic = RTC_STATE_MAGIC;
+  fillSettingsBlob(rtcState.settings);
+  rtcState.settingsSlotA = settingsSlotA;
+  fillPeerTable(rtcState.peers);
+  rtcState.effectIndex = effectIndex;
+  rtcState.colorIndex = colorIndex;
+  rtcState.color[0] = currentColor.r;
+  rtcState.color[1] = currentColor.g;
+  rtcState.color[2] = currentColor.b;
+  rtcState.crc = rtcStateCrc(rtcState);
+}
+
+// Returns false when RTC memory holds nothing usable (cold boot, other
+// firmware, or a layout change).
+bool restoreRtcState() {
+  if (rtcState.magic != RTC_STATE_MAGIC || rtcState.crc != rtcStateCrc(rtcState)) return false;
+  if (rtcState.settings.version != SETTINGS_BLOB_VERSION || rtcState.peers.version != PEER_TABLE_VERSION) return false;
+
+  applySettingsBlob(rtcState.settings);
+  settingsSlotA = rtcState.settingsSlotA;
+  applyPeerTable(rtcState.peers);
+  effectIndex = constrain(rtcState.effectIndex, 0, (int)EFFECT_COUNT - 1);
+  colorIndex = rtcState.colorIndex;
+  currentColor = CRGB(rtcState.color[0], rtcState.color[1], rtcState.color[2]);
+  rtcState.magic = 0;  // Used once; a later reset takes the normal path
+  return true;
+}
 
+void defaultPreferences() {
   Serial.println("Preferences loaded into in-memory variables:");
   Serial.println("Role: " + savedRole);
   Serial.println("SSID: " + ssid);
@@ -567,26 +1622,81 @@ void defaultPreferences() {
   ledEffects.setColor(initialColor);
   ledEffects.setSportsEffectColors(sportsEffectColor1, sportsEffectColor2);
 
-  preferences.end();
   deviceRole = (savedRole == "PRIMARY") ? PRIMARY : SECONDARY;
 }
 
+// ---------------------- Settings Cache ----------------------
+void markSettingDirty(uint16_t setting) {
+  dirtySettings |= setting;
+  lastSettingChange = millis();
+  settingsWritesRequested++;
+}
+
+void flushSettings() {
+  if (!dirtySettings) return;
+
+  uint32_t start = micros();
+  uint16_t dirty = dirtySettings;
+  dirtySettings = 0;
+
+  preferences.begin("cornhole", false);
+  if (dirty & ~SETTING_PEERS) writeSettingsBlob();
+  if (dirty & SETTING_PEERS) {
+    PeerLinkStats stats[MAX_PEERS];
+    portENTER_CRITICAL(&espNowTxMux);
+    memcpy(stats, linkStats, sizeof(stats));
+    portEXIT_CRITICAL(&espNowTxMux);
+
+    portENTER_CRITICAL(&peerMux);
+    for (int i = 0; i < peerCount; i++) {
+      for (int j = 0; j < MAX_PEERS; j++) {
+        if (!stats[j].used || !stats[j].sent || memcmp(stats[j].mac, knownPeers[i], 6) != 0) continue;
+        peerMeta[i].linkQuality = min(100UL, (unsigned long)stats[j].acked * 100 / stats[j].sent);
+      }
+    }
+    portEXIT_CRITICAL(&peerMux);
+    writePeerTable();
+  }
+  preferences.end();
+
+  settingsWritesPerformed++;
+  lastFlushMicros = micros() - start;
+  maxFlushMicros = max(maxFlushMicros, lastFlushMicros);
+
+  Serial.printf("💾 Settings flushed in %lu us (max %lu us); NVS writes avoided: %lu\n",
+                (unsigned long)lastFlushMicros, (unsigned long)maxFlushMicros,
+                (unsigned long)(settingsWritesRequested - settingsWritesPerformed));
+}
+
+// Every reboot goes through here so pending settings are not lost.
+void restartBoard() {
+  flushSettings();
+  if (!rtcStateCleared) saveRtcState();
+  ESP.restart();
+}
+
 // ---------------------- Setup ESP-NOW ----------------------
+// Runs on the radios or espNowInit task, never loop().
 void setupEspNow() {
   WiFi.disconnect(true);
-
-  delay(100);
   WiFi.mode(WIFI_AP_STA);
   esp_wifi_set_promiscuous(true);  // <-- Required before setting channel
   esp_wifi_set_channel(1, WIFI_SECOND_CHAN_NONE);
   esp_wifi_set_promiscuous(false);  // <-- Restore normal state
-  delay(random(300, 2000));         // Helps stagger role elections
 
   if (esp_now_init() != ESP_OK) {
     Serial.println("❌ ESP-NOW init failed");
     //return;
+  } else {
+    espNowReady = true;
+    Serial.println("✅ ESP-NOW initialized");
+  }
+
+  if (espNowRxQueue == NULL) {
+    espNowRxQueue = xQueueCreate(ESPNOW_RX_QUEUE_LEN, sizeof(espnow_rx_frame));
+    espNowAppQueue = xQueueCreate(ESPNOW_APP_QUEUE_LEN, sizeof(espnow_rx_frame));
+    xTaskCreatePinnedToCore(commsTask, "comms", 6144, NULL, 3, &commsTaskHandle, 0);
   }
-  Serial.println("✅ ESP-NOW initialized");
 
   // Always register callbacks after init
   esp_now_register_recv_cb(onDataRecv);
@@ -606,80 +1716,199 @@ void setupEspNow() {
       Serial.println("❌ Failed to add broadcast peer");
     }
   }
-}
 
-// ---------------------- Role Resolution ----------------------
-void saveNewRole(const String &role) {
-  preferences.begin("cornhole", false);
-  preferences.putString("deviceRole", role);
-  preferences.end();
-  Serial.println("Saved Role: " + role);
-  deviceRole = (savedRole == "PRIMARY") ? PRIMARY : SECONDARY;
+  registerKnownPeers();
 }
 
-void resolveRole() {
-  //delay(1000);
-  String announce = "ROLE: " + savedRole;
-  esp_err_t result = esp_now_send(broadcastMAC, (uint8_t *)announce.c_str(), announce.length());
-  Serial.println("📣 Broadcasting role: " + announce);
-  if (result != ESP_OK) {
-    Serial.println("❌ Failed to send ESP-NOW broadcast!");
-  }
-
-  unsigned long startTime = millis();
+// Re-initializes ESP-NOW on a task of its own; loop() carries on, and a
+// request while one is running is dropped.
+void restartEspNow() {
+  if (espNowRestarting.exchange(true)) return;
+  if (xTaskCreatePinnedToCore(espNowInitTask, "espNowInit", 4096, NULL, 1, NULL, 0) != pdPASS) espNowRestarting = false;
+}
 
-  while (millis() - startTime < 2000) {
-    if (espNowDataReceived) {
-      espNowDataReceived = false;
-      String msg = espNowDataBuffer;
-      espNowDataBuffer = "";
+void espNowInitTask(void *param) {
+  esp_now_deinit();  // Ensure clean reinit
+  setupEspNow();
+  espNowRestarting = false;
+  vTaskDelete(NULL);
+}
 
-      if (msg.startsWith("ROLE: ")) {
-        roleMessageSeen = true;
-        setupRole = msg.substring(6);
+void registerKnownPeers() {
+  uint8_t peers[MAX_PEERS][6];
+  int count = copyKnownPeers(peers);
+  for (int i = 0; i < count; i++) {
+    if (esp_now_is_peer_exist(peers[i])) continue;
+    esp_now_peer_info_t peerInfo = {};
+    memcpy(peerInfo.peer_addr, peers[i], 6);
+    peerInfo.channel = 0;
+    peerInfo.encrypt = false;
+    esp_now_add_peer(&peerInfo);
+  }
+}
 
-        if (setupRole == savedRole) {
-          String response = "We are both: " + savedRole;
-          Serial.println("⚠️ Conflict detected. Responding with: " + response);
-          esp_now_send(broadcastMAC, (uint8_t *)response.c_str(), response.length());
-        } else {
-          String response = "We are different roles: ";
-          esp_now_send(broadcastMAC, (uint8_t *)response.c_str(), response.length());
-          Serial.println("👋 The other board is: " + setupRole);
-        }
-      } else if (msg.startsWith("We are both:")) {
-        roleMessageSeen = true;
-        setupRole = msg.substring(13);
-        Serial.println("🤝 Conflict detected: both boards are " + setupRole);
+// Expects peerMux to be held.
+int findPeerSlot(const uint8_t *mac) {
+  for (int i = 0; i < peerCount; i++) {
+    if (memcmp(mac, knownPeers[i], 6) == 0) return i;
+  }
+  return -1;
+}
 
-        if (setupRole == "PRIMARY") {
-          savedRole = "SECONDARY";
-        } else {
-          savedRole = "PRIMARY";
-        }
-        saveNewRole(savedRole);
+// Snapshot of knownPeers for code that talks to ESP-NOW. Returns the count.
+int copyKnownPeers(uint8_t peers[MAX_PEERS][6]) {
+  portENTER_CRITICAL(&peerMux);
+  int count = peerCount;
+  memcpy(peers, knownPeers, count * 6);
+  portEXIT_CRITICAL(&peerMux);
+  return count;
+}
 
-      } else if (msg.startsWith("We are different roles")) {
-        roleMessageSeen = true;  // Prevent fallback promotion
-        Serial.println("🤝 Role resolution completed with: " + msg);
+// Runs on the comms task. Returns the peer's slot, evicting the least
+// recently seen peer when the table is full. A peer already in the table
+// keeps its slot and is only registered with ESP-NOW again; a new one
+// flags the table for loop() to save.
+int addKnownPeer(const uint8_t *mac) {
+  uint8_t evicted[6];
+  bool evict = false;
+  bool added = false;
+
+  portENTER_CRITICAL(&peerMux);
+  int slot = findPeerSlot(mac);
+  if (slot < 0) {
+    added = true;
+    slot = peerCount;
+    if (peerCount < MAX_PEERS) {
+      peerCount++;
+    } else {
+      slot = 0;
+      for (int i = 1; i < MAX_PEERS; i++) {
+        if (peerMeta[i].lastSeen < peerMeta[slot].lastSeen) slot = i;
       }
+      memcpy(evicted, knownPeers[slot], 6);
+      evict = true;
+      if (evictedCount < MAX_PEERS) memcpy(evictedPeers[evictedCount++], evicted, 6);
     }
+    memcpy(knownPeers[slot], mac, 6);
+    memset(&peerMeta[slot], 0, sizeof(PeerMeta));
   }
-  // ⏰ Fallback if no one responded and we're a SECONDARY
-  if (!roleMessageSeen && savedRole == "SECONDARY") {
-    Serial.println("⏰ No PRIMARY found, promoting to PRIMARY");
-    savedRole = "PRIMARY";
-    saveNewRole(savedRole);
+  peerMeta[slot].lastSeen = ++peerClock;
+  portEXIT_CRITICAL(&peerMux);
+
+  if (added) peerTableChanged = true;
+  if (evict) {
+    Serial.println("♻️ Peer table full, evicting " + macToString(evicted));
+    esp_now_del_peer(evicted);
+    forgetLinkStats(evicted);
+  }
+  if (!esp_now_is_peer_exist(mac)) {
+    esp_now_peer_info_t peerInfo = {};
+    memcpy(peerInfo.peer_addr, mac, 6);
+    peerInfo.channel = 0;
+    peerInfo.encrypt = false;
+    esp_now_add_peer(&peerInfo);
+  }
+  return slot;
+}
+
+// Runs on loop(), which owns secondaryBoards: drops the boards addKnownPeer()
+// evicted, so the app stops listing them.
+void pruneEvictedPeers() {
+  uint8_t evicted[MAX_PEERS][6];
+  portENTER_CRITICAL(&peerMux);
+  int count = evictedCount;
+  memcpy(evicted, evictedPeers, count * 6);
+  evictedCount = 0;
+  portEXIT_CRITICAL(&peerMux);
+
+  for (int i = 0; i < count; i++) {
+    secondaryBoards.erase(std::remove_if(secondaryBoards.begin(), secondaryBoards.end(),
+                                         [&](const BoardInfo &b) { return memcmp(b.mac, evicted[i], 6) == 0; }),
+                          secondaryBoards.end());
+  }
+}
+
+// ---------------------- Role Resolution ----------------------
+void saveNewRole(const String &role) {
+  savedRole = role;
+  markSettingDirty(SETTING_ROLE);
+  flushSettings();
+  Serial.println("Saved Role: " + role);
+  deviceRole = (savedRole == "PRIMARY") ? PRIMARY : SECONDARY;
+}
+
+// Non-blocking: announces the saved role and lets serviceElection() settle it.
+void startRoleElection() {
+  electionStartTime = millis();
+  announceRole();
+}
+
+void announceRole() {
+  const char *announce = deviceRole == PRIMARY ? "ROLE: PRIMARY" : "ROLE: SECONDARY";
+  lastRoleAnnounceMs = millis();
+  esp_err_t result = espNowSend(broadcastMAC, (const uint8_t *)announce, strlen(announce));
+  Serial.printf("📣 Broadcasting role: %s\n", announce);
+  if (result != ESP_OK) {
+    Serial.println("❌ Failed to send ESP-NOW broadcast!");
+  }
+}
+
+// Runs on the comms task.
+void noteRoleClaim(const uint8_t *mac, bool primary, uint8_t session) {
+  portENTER_CRITICAL(&roleMux);
+  bool answer = recordRoleClaim(roleClaims, MAX_PEERS, mac, primary, session, millis());
+  portEXIT_CRITICAL(&roleMux);
+
+  Serial.printf("👋 %s claims %s\n", macToString(mac).c_str(), primary ? "PRIMARY" : "SECONDARY");
+  if (answer) announceRole();
+}
+
+// Called from loop(): applies any role change the claims call for and keeps
+// our own claim from expiring on the other boards.
+void serviceElection() {
+  unsigned long now = millis();
+  portENTER_CRITICAL(&roleMux);
+  RoleDecision decision = decideRole(roleClaims, MAX_PEERS, deviceMAC, deviceRole == PRIMARY, electionStartTime, now);
+  portEXIT_CRITICAL(&roleMux);
+
+  if (decision == ROLE_STEP_DOWN) {
+    Serial.println("🤝 A lower MAC is PRIMARY, stepping down to SECONDARY");
+    saveNewRole("SECONDARY");
+    stopBleServer();
+    announceRole();
+  } else if (decision == ROLE_PROMOTE) {
+    Serial.println("⏰ No PRIMARY found, promoting to PRIMARY");
+    saveNewRole("PRIMARY");
+    if (pServer == NULL) {
+      setupBT();
+    } else {
+      pServer->startAdvertising();  // Stopped when this board last stepped down
+    }
+    announceRole();
+  } else if (now - lastRoleAnnounceMs.load() >= ROLE_REANNOUNCE_MS) {
+    announceRole();
   }
 }
 
 void printPeers() {
+  uint8_t peers[MAX_PEERS][6];
+  int count = copyKnownPeers(peers);
   Serial.println("🧩 Known peers:");
-  for (int i = 0; i < peerCount; i++) {
-    Serial.println("  → " + macToString(knownPeers[i]));
+  for (int i = 0; i < count; i++) {
+    Serial.println("  → " + macToString(peers[i]));
   }
 }
 
+// A SECONDARY boots without BLE, so one that steps down stops advertising
+// and drops the app. The server is kept for a later promotion, as the
+// Arduino BLE stack cannot be brought up again after a deinit.
+void stopBleServer() {
+  if (pServer == NULL) return;
+  BLEDevice::getAdvertising()->stop();
+  if (pServer->getConnectedCount() > 0) pServer->disconnect(pServer->getConnId());
+  Serial.println("BLE advertising stopped");
+}
+
 // ---------------------- Setup BLE (PRIMARY only) ----------------------
 void setupBT() {
   Serial.println("Initializing BLE...");
@@ -687,6 +1916,12 @@ void setupBT() {
   // Initialize BLE Device
   BLEDevice::init("CornholeBT");
   BLEDevice::setMTU(512);
+  BLEDevice::setCustomGattsHandler(bleGattsEvent);
+
+  if (bleNotifyQueue == NULL) {
+    bleNotifyQueue = xQueueCreate(BLE_NOTIFY_QUEUE_LEN, sizeof(ble_notify_msg));
+    xTaskCreatePinnedToCore(bleTxTask, "bleTx", 4096, NULL, 1, &bleTxTaskHandle, 0);
+  }
 
   // Create the BLE Server
   pServer = BLEDevice::createServer();
@@ -716,7 +1951,7 @@ const char* firmwareVersion = getFirmwareVersion();
 
   pOtaCharacteristic = pService->createCharacteristic(
     OTA_CHARACTERISTIC_UUID,
-    BLECharacteristic::PROPERTY_WRITE);
+    BLECharacteristic::PROPERTY_READ | BLECharacteristic::PROPERTY_WRITE | BLECharacteristic::PROPERTY_WRITE_NR);
 
   pOtaCharacteristic->addDescriptor(new BLE2902());
   pOtaCharacteristic->setCallbacks(new OTAWriteCallback());  // Start the service
@@ -743,263 +1978,421 @@ const char* firmwareVersion = getFirmwareVersion();
 
 
 // ---------------------- Data Handling Functions ----------------------
-void handleBluetoothData(String command) {
-  String accumulatedData = command;  // Accumulate the incoming command
-
-  // Check if the accumulated data contains a full command (terminated by ';')
-  int endIndex = accumulatedData.indexOf(';');
-
-  while (endIndex != -1) {
-    String completeCommand = accumulatedData.substring(0, endIndex);
+void handleBluetoothData() {
+  uint8_t chunk[64];
+  size_t n;
+  uint32_t rxUs = bleRxFirstUs.exchange(0);
+
+  // Commands are terminated by ';' and may span several BLE writes, so the
+  // partial command is kept in bleCommandLine between calls.
+  while ((n = bleRxRing.pop(chunk, sizeof(chunk))) > 0) {
+    for (size_t i = 0; i < n; i++) {
+      char c = (char)chunk[i];
+      if (c != ';') {
+        if (bleCommandLen < BLE_COMMAND_MAX_LEN - 1) {
+          bleCommandLine[bleCommandLen++] = c;
+        } else {
+          bleCommandOverflow = true;
+        }
+        continue;
+      }
 
-    // Process the complete command
-    Serial.println("Received full data: " + completeCommand);
-    processCommand(completeCommand);
-    esp_err_t result = esp_now_send(broadcastMAC, (uint8_t *)completeCommand.c_str(), completeCommand.length());
-    Serial.printf("📤ESP-NOW Sending by %s: %s %s\n", macToString(hostMAC).c_str(), completeCommand.c_str(),
-                  result == ESP_OK ? "✅" : "❌");
-    //sendData("espNow", completeCommand, "");
-    if (result != ESP_OK) {
-      setupEspNow();
+      bleCommandLine[bleCommandLen] = '\0';
+      if (bleCommandOverflow) {
+        bleOversizeCommands++;
+        Serial.printf("⚠️ Dropped oversize BLE command (%lu total)\n", (unsigned long)bleOversizeCommands);
+      } else if (bleCommandLen > 0) {
+        String completeCommand = String(bleCommandLine);
+
+        // Process the complete command
+        Serial.println("Received full data: " + completeCommand);
+        processCommand(completeCommand);
+        if (rxUs) recordCommandLatency(rxUs);
+        if (completeCommand != "CMD:INFO") {  // cmdInfo() forwards it with the reply slots
+          bool sent = sendToPeers((const uint8_t *)completeCommand.c_str(), completeCommand.length());
+          Serial.printf("📤ESP-NOW Sending by %s: %s %s\n", macToString(hostMAC).c_str(), completeCommand.c_str(),
+                        sent ? "✅" : "❌");
+          if (!sent) {
+            restartEspNow();
+          }
+        }
+      }
+      bleCommandLen = 0;
+      bleCommandOverflow = false;
     }
-    // Remove the processed command from accumulated data
-    accumulatedData = accumulatedData.substring(endIndex + 1);
+  }
 
-    // Check for the next command in the remaining data
-    endIndex = accumulatedData.indexOf(';');
+  uint32_t drops = bleRxRing.getDroppedWrites();
+  if (drops != bleReportedDrops) {
+    bleReportedDrops = drops;
+    Serial.printf("⚠️ BLE RX ring overflow: %lu writes / %lu bytes dropped\n", (unsigned long)drops, (unsigned long)bleRxRing.getDroppedBytes());
   }
+
   lastSystemActivityTime = millis();
   inactivityHandled = false;
 }
 
-void processCommand(String command) {
+// ---------------------- Command Dispatch ----------------------
+void cmdBle(const char *args) {
+  sendBleStats();
+}
 
-  lastSystemActivityTime = millis();
-  inactivityHandled = false;
+void cmdBoot(const char *args) {
+  sendBootPhases();
+}
 
+void cmdClear(const char *args) {
+  dirtySettings = 0;  // Nothing pending may be written back after the clear
+  rtcStateCleared = true;
   preferences.begin("cornhole", false);
-  if (command.startsWith("CMD:CLEAR")) {
-    preferences.clear();  // Clear all preferences
-    preferences.end();    // Clear all preferences
-    //const char *message = "CLEAR_ALL";
-    //esp_err_t result = esp_now_send(peerMAC, (uint8_t *)message, strlen(message));
-    Serial.println("All saved variables cleared.");
-    sendData("espNow", "CMD", "CLEAR");
-    sendRestartCommand();
-    lastEspNowMessage = "";
-    lastAppMessage = "";
+  preferences.clear();  // Clear all preferences
+  preferences.end();
+  Serial.println("All saved variables cleared.");
+  sendData("espNow", "CMD", "CLEAR");
+  sendRestartCommand();
+  lastAppMessage = "";
+}
+
+void cmdIdentify(const char *args) {
+  String targetMacStr = String(args);
+  targetMacStr.replace("-", ":");
+  String localMacStr = macToString(deviceMAC);
+
+  Serial.printf("IDENTIFY check. Target: %s, Local: %s\n", targetMacStr.c_str(), localMacStr.c_str());
+
+  if (targetMacStr.equalsIgnoreCase(localMacStr)) {
+    Serial.println("🔍 IDENTIFY MATCH — flashing LEDs");
+    identifying = true;
+    identifyStartTime = millis();
+    publishRenderSettings();
+    deferAction(endIdentify, IDENTIFY_FLASHES * 2 * IDENTIFY_HALF_PERIOD_MS);
+  } else if (deviceRole == PRIMARY) {
+    // Only the board the app talks to forwards; a SECONDARY that re-sent
+    // a miss would bounce it between boards with a fresh seq every hop
+    Serial.println("🔄 IDENTIFY not for this board — forwarding...");
+    sendData("espNow", "CMD", "IDENTIFY:" + targetMacStr);
+  } else {
+    Serial.println("IDENTIFY not for this board — ignored");
+  }
+}
+
+void cmdInfo(const char *args) {
+  if (deviceRole == PRIMARY && *args == '\0') {
+    // From the app: handleBluetoothData() leaves the forward to us, so the
+    // request can carry the slot order
+    uint8_t peers[MAX_PEERS][6];
+    int count = copyKnownPeers(peers);
+    infoRequestAt = millis();
+    infoRepliesExpected = count;
+    infoRepliesReceived = 0;
+    infoRefreshActive = count > 0;
+
+    char request[ESPNOW_MAX_PAYLOAD];
+    size_t len = snprintf(request, sizeof(request), "CMD:INFO:");
+    len += formatInfoSlots(request + len, sizeof(request) - len, peers, count);
+    sendToPeers((const uint8_t *)request, len);
+    infoSlot = 0;
+  } else {
+    infoSlot = deviceRole == PRIMARY ? 0 : infoSlotFor(args, deviceMAC);
+  }
+  // peerMAC follows every frame; by the time the slot comes up it may
+  // name another board
+  memcpy(infoReplyMac, peerMAC, 6);
+  deferAction(sendInfoReply, infoSlot * INFO_SLOT_MS);
+}
+
+void sendInfoReply() {
+  if (savedRole == "SECONDARY") {
+    struct_message outgoing;
+    strncpy(outgoing.device, "SECONDARY", sizeof(outgoing.device));
+    strncpy(outgoing.name, boardName.c_str(), sizeof(outgoing.name));
+    memcpy(outgoing.macAddr, deviceMAC, 6);
+    outgoing.batteryLevel = readBatteryLevel();
+    outgoing.batteryVoltage = (int)readBatteryVoltage();
+    memset(outgoing.version, 0, sizeof(outgoing.version));
+    strncpy(outgoing.version, getFirmwareVersion(), sizeof(outgoing.version) - 1);
+
+    espNowSendReliable(infoReplyMac, (uint8_t *)&outgoing, sizeof(outgoing), nextSeq(espNowTxSeq));
+    Serial.printf("📡 Sent board info struct to PRIMARY in slot %d\n", infoSlot);
+  } else {
+    sendBoardInfo();
+  }
+}
+
+void cmdLedBench(const char *args) {
+  runLedBenchmark();
+}
+
+void cmdLinkStats(const char *args) {
+  sendLinkStats();
+}
+
+void cmdPerf(const char *args) {
+  if (strcmp(args, "RESET") == 0) {
+    resetPerfStats();
+    Serial.println("Frame profiler reset.");
     return;
-  } else if (command.startsWith("n2:")) {
-    //Serial.println("Sending Board 2 info to App: " + command);
-
-  } else if (command.startsWith("IC:")) {
-    int r, g, b;
-    sscanf(command.c_str(), "IC:%d,%d,%d", &r, &g, &b);
-    initialColor = CRGB(constrain(r, 0, 255), constrain(g, 0, 255), constrain(b, 0, 255));
-    preferences.putInt("initialColorR", r);
-    preferences.putInt("initialColorG", g);
-    preferences.putInt("initialColorB", b);
-    ledEffects.setColor(initialColor);
-    ledEffects.setInitialColor(initialColor);
-    Serial.println("Initial color updated.");
-
-  } else if (command.startsWith("SC1:")) {
-    int r, g, b;
-    sscanf(command.c_str(), "SC1:%d,%d,%d", &r, &g, &b);
-    CRGB newColor1 = CRGB(constrain(r, 0, 255), constrain(g, 0, 255), constrain(b, 0, 255));
-    preferences.putInt("sportsColor1R", r);
-    preferences.putInt("sportsColor1G", g);
-    preferences.putInt("sportsColor1B", b);
-    ledEffects.setSportsEffectColors(newColor1, sportsEffectColor2);
-    Serial.println("Sports Effect Color1 updated.");
-
-  } else if (command.startsWith("SC2:")) {
-    int r, g, b;
-    sscanf(command.c_str(), "SC2:%d,%d,%d", &r, &g, &b);
-    CRGB newColor2 = CRGB(constrain(r, 0, 255), constrain(g, 0, 255), constrain(b, 0, 255));
-    preferences.putInt("sportsColor2R", r);
-    preferences.putInt("sportsColor2G", g);
-    preferences.putInt("sportsColor2B", b);
-    ledEffects.setSportsEffectColors(sportsEffectColor1, newColor2);
-    Serial.println("Sports Effect Color2 updated.");
-
-  } else if (command.startsWith("B1:")) {
-    boardName = command.substring(3);
-    preferences.putString("boardName", boardName);
-    Serial.println("Board Name updated to: " + boardName);
-
-
-  } else if (command.startsWith("B2:")) {
-
-  } else if (command.startsWith("BRIGHT:")) {
-    sscanf(command.c_str(), "BRIGHT:%d", &brightness);
-    brightness = constrain(brightness, 0, 255);
-    preferences.putInt("brightness", brightness);
-    ledEffects.setBrightness(brightness);
-    Serial.println("Brightness updated to: " + String(brightness));
-
-  } else if (command.startsWith("SIZE:")) {
-    sscanf(command.c_str(), "SIZE:%lu", &blockSize);
-    preferences.putULong("blockSize", blockSize);
-    ledEffects.setBlockSize(blockSize);
-    Serial.println("Block Size updated to: " + String(blockSize));
-
-  } else if (command.startsWith("SPEED:")) {
-    sscanf(command.c_str(), "SPEED:%lu", &effectSpeed);
-    preferences.putULong("effectSpeed", effectSpeed);
-    ledEffects.setEffectSpeed(effectSpeed);
-    Serial.println("Effect Speed updated to: " + String(effectSpeed));
-
-  } else if (command.startsWith("CELEB:")) {
-    sscanf(command.c_str(), "CELEB:%lu", &irTriggerDuration);
-    preferences.putULong("irTriggerDuration", irTriggerDuration);
-    Serial.println("IR Trigger Duration updated to: " + String(irTriggerDuration));
-
-  } else if (command.startsWith("TIMEOUT:")) {
-    sscanf(command.c_str(), "TIMEOUT:%d", &inactivityTimeout);
-    preferences.putInt("inactivityTimeout", inactivityTimeout);
-    Serial.println("Inactivity Timeout updated to: " + String(inactivityTimeout));
-
-  } else if (command.startsWith("DEEPSLEEP:")) {
-    sscanf(command.c_str(), "DEEPSLEEP:%d", &deepSleepTimeout);
-    preferences.putInt("deepSleepTimeout", deepSleepTimeout);
-    Serial.println("Deep Sleep Timeout updated to: " + String(deepSleepTimeout));
-
-  } else if (command.startsWith("Effect:")) {
-    String effect = command.substring(7);
-    effectIndex = getEffectIndex(effect);  // Set the effect index based on received effect
-    ledEffects.applyEffect(effect);
-    Serial.println("Effect set to: " + effects[effectIndex]);
-
-  } else if (command.startsWith("ColorIndex:")) {
-    int index = command.substring(11).toInt();
-    if (index >= 0 && index < (sizeof(colors) / sizeof(colors[0]))) {
-      colorIndex = index;
-      currentColor = colors[colorIndex];
-      ledEffects.setColor(currentColor);
-      //      sendData("espNow", "ColorIndex", String(colorIndex));
-      if (deviceRole == PRIMARY) {
-        sendData("app", "ColorIndex", String(colorIndex));
-      }
+  }
+  sendPerfStats();
+}
 
-    } else {
-      Serial.println("Invalid color index");
-    }
-  } else if (command.startsWith("brightness:")) {  // Not sure if needed
-    sscanf(command.c_str(), "brightness:%d", &brightness);
-    ledEffects.setBrightness(brightness);  // Use library's method if available
-    Serial.println("Brightness set to: " + String(brightness));
+void cmdRender(const char *args) {
+  sendRenderStats();
+}
+
+void cmdRestart(const char *args) {
+  sendRestartCommand();
+}
+
+void cmdSettings(const char *args) {
+  sendSettings();
+  Serial.println("Settings sent.");
+}
 
+void cmdSleep(const char *args) {
+  Serial.println("App Command: Entering deep sleep...");
 
-  } else if (command.startsWith("CMD:SLEEP")) {
-    Serial.println("App Command: Entering deep sleep...");
+  if (deviceRole == PRIMARY) {
+    sendData("espNow", "CMD", "SLEEP");
+  }
+
+  scheduleDeepSleep(200);
+}
+
+void cmdAck(const char *args) {
+  Serial.println("OK!");
+}
+
+void cmdBoard1Name(const char *args) {
+  boardName = String(args);
+  markSettingDirty(SETTING_BOARD_NAME);
+  Serial.println("Board Name updated to: " + boardName);
+}
 
+void cmdIgnore(const char *args) {
+}
+
+void cmdBright(const char *args) {
+  sscanf(args, "%d", &brightness);
+  brightness = constrain(brightness, 0, 255);
+  markSettingDirty(SETTING_BRIGHTNESS);
+  publishRenderSettings();
+  Serial.println("Brightness updated to: " + String(brightness));
+}
+
+void cmdCeleb(const char *args) {
+  sscanf(args, "%lu", &irTriggerDuration);
+  markSettingDirty(SETTING_IR_DURATION);
+  Serial.println("IR Trigger Duration updated to: " + String(irTriggerDuration));
+}
+
+void cmdColorIndex(const char *args) {
+  int index = atoi(args);
+  if (index >= 0 && index < (sizeof(colors) / sizeof(colors[0]))) {
+    colorIndex = index;
+    currentColor = colors[colorIndex];
+    publishRenderSettings();
     if (deviceRole == PRIMARY) {
-      sendData("espNow", "CMD", "SLEEP");
+      sendData("app", "ColorIndex", String(colorIndex));
     }
+  } else {
+    Serial.println("Invalid color index");
+  }
+}
 
-    FastLED.clear(true);  // Clears all LEDs and shows black
-    delay(200);           // Ensure it gets shown before sleeping    delay(100);  // allow message to print
-    deepSleep();
-    return;
+void cmdDeepSleep(const char *args) {
+  sscanf(args, "%d", &deepSleepTimeout);
+  markSettingDirty(SETTING_DEEP_SLEEP_TIMEOUT);
+  Serial.println("Deep Sleep Timeout updated to: " + String(deepSleepTimeout));
+}
 
-  } else if (command.startsWith("toggleLights")) {
-    String status = command.substring(13);
-    bool lightsStatus = (status == "on");
-    toggleLights(lightsStatus);
-    Serial.println("Lights toggled to: " + String(status));
-
-  } else if (command.startsWith("toggleEspNow")) {
-    String status = command.substring(13);
-    bool espNowStatus = (status == "on");
-    toggleEspNow(espNowStatus);
-    Serial.println("ESP-NOW toggled to: " + String(status));
-
-  } else if (command.startsWith("CMD:RESTART")) {
-    sendRestartCommand();
-
-  } else if (command.startsWith("CMD:SETTINGS")) {
-    sendSettings();
-    Serial.println("Settings sent.");
-
-  } else if (command.startsWith("CMD:INFO")) {
-    delay(random(300, 3000));
-    if (savedRole == "SECONDARY") {
-      struct_message outgoing;
-      strncpy(outgoing.device, "SECONDARY", sizeof(outgoing.device));
-      strncpy(outgoing.name, boardName.c_str(), sizeof(outgoing.name));
-      memcpy(outgoing.macAddr, deviceMAC, 6);
-      outgoing.batteryLevel = readBatteryLevel();
-      outgoing.batteryVoltage = (int)readBatteryVoltage();
-
-      esp_now_send(peerMAC, (uint8_t *)&outgoing, sizeof(outgoing));
-      Serial.println("📡 Sent board info struct to PRIMARY in response to GET_INFO");
-    } else {
-      sendBoardInfo();
-    }
-  } else if (command.startsWith("SET_ROLE:SECONDARY")) {
-    String newRole = command.substring(9);
-    Serial.println("newRole extracted: " + newRole);
-    preferences.begin("cornhole", false);
-    preferences.putString("deviceRole", "SECONDARY");
-    Serial.println("Wrote deviceRole: " + newRole);
-    preferences.end();
-    Serial.println("Role updated to: " + newRole);
-    String currentMessage = "SET_ROLE:PRIMARY";
-    esp_now_send(peerMAC, (uint8_t *)currentMessage.c_str(), currentMessage.length());
-    delay(random(300, 3000));
-    ESP.restart();
-
-  } else if (command.startsWith("SET_ROLE:PRIMARY")) {
-    String newRole = command.substring(9);
-    preferences.begin("cornhole", false);
-    preferences.putString("deviceRole", "PRIMARY");
-    Serial.println("Wrote deviceRole: " + newRole);
-    preferences.end();
-    Serial.println("Role updated to: " + newRole);
-    delay(random(300, 3000));
-    ESP.restart();
+void cmdEffect(const char *args) {
+  String effect = String(args);
+  effectIndex = getEffectIndex(effect);  // Set the effect index based on received effect
+  publishRenderSettings();
+  Serial.println("Effect set to: " + effects[effectIndex]);
+}
+
+void cmdFps(const char *args) {
+  renderFps = constrain(atoi(args), RENDER_FPS_MIN, RENDER_FPS_MAX);
+  Serial.println("Render rate set to: " + String(renderFps) + " fps");
+}
+
+void cmdInitialColor(const char *args) {
+  int r, g, b;
+  sscanf(args, "%d,%d,%d", &r, &g, &b);
+  initialColor = CRGB(constrain(r, 0, 255), constrain(g, 0, 255), constrain(b, 0, 255));
+  markSettingDirty(SETTING_INITIAL_COLOR);
+  currentColor = initialColor;
+  publishRenderSettings();
+  Serial.println("Initial color updated.");
+}
+
+void cmdSportsColor1(const char *args) {
+  int r, g, b;
+  sscanf(args, "%d,%d,%d", &r, &g, &b);
+  CRGB newColor1 = CRGB(constrain(r, 0, 255), constrain(g, 0, 255), constrain(b, 0, 255));
+  sportsEffectColor1 = newColor1;
+  markSettingDirty(SETTING_SPORTS_COLOR1);
+  publishRenderSettings();
+  Serial.println("Sports Effect Color1 updated.");
+}
+
+void cmdSportsColor2(const char *args) {
+  int r, g, b;
+  sscanf(args, "%d,%d,%d", &r, &g, &b);
+  CRGB newColor2 = CRGB(constrain(r, 0, 255), constrain(g, 0, 255), constrain(b, 0, 255));
+  sportsEffectColor2 = newColor2;
+  markSettingDirty(SETTING_SPORTS_COLOR2);
+  publishRenderSettings();
+  Serial.println("Sports Effect Color2 updated.");
+}
+
+void cmdSetRolePrimary(const char *args) {
+  saveNewRole("PRIMARY");
+  scheduleRestart(random(300, 3000));
+}
+
+void cmdSetRoleSecondary(const char *args) {
+  saveNewRole("SECONDARY");
+  String currentMessage = "SET_ROLE:PRIMARY";
+  espNowSend(peerMAC, (uint8_t *)currentMessage.c_str(), currentMessage.length());
+  scheduleRestart(random(300, 3000));
+}
+
+void cmdSize(const char *args) {
+  sscanf(args, "%lu", &blockSize);
+  markSettingDirty(SETTING_BLOCK_SIZE);
+  publishRenderSettings();
+  Serial.println("Block Size updated to: " + String(blockSize));
+}
+
+void cmdSpeed(const char *args) {
+  sscanf(args, "%lu", &effectSpeed);
+  markSettingDirty(SETTING_EFFECT_SPEED);
+  publishRenderSettings();
+  Serial.println("Effect Speed updated to: " + String(effectSpeed));
+}
+
+void cmdTimeout(const char *args) {
+  sscanf(args, "%d", &inactivityTimeout);
+  markSettingDirty(SETTING_INACTIVITY_TIMEOUT);
+  Serial.println("Inactivity Timeout updated to: " + String(inactivityTimeout));
+}
+
+void cmdBrightnessLive(const char *args) {  // Not sure if needed
+  sscanf(args, "%d", &brightness);
+  publishRenderSettings();
+  Serial.println("Brightness set to: " + String(brightness));
+}
+
+void cmdToggleEspNow(const char *args) {
+  bool espNowStatus = (strcmp(args, "on") == 0);
+  toggleEspNow(espNowStatus);
+  Serial.println("ESP-NOW toggled to: " + String(args));
+}
+
+void cmdToggleLights(const char *args) {
+  bool lightsStatus = (strcmp(args, "on") == 0);
+  toggleLights(lightsStatus);
+  Serial.println("Lights toggled to: " + String(args));
+}
+
+// Sorted by strcmp() order; parseCommand() binary-searches it.
+constexpr CommandEntry commandTable[] = { COMMAND_TABLE(COMMAND_ENTRY) };
+constexpr size_t COMMAND_COUNT = sizeof(commandTable) / sizeof(commandTable[0]);
+static_assert(commandTableSorted(commandTable, COMMAND_COUNT), "commandTable must be sorted and unique");
 
-  } else if (command.startsWith("r2:")) {
-    Serial.println("Sending SECONDARY info to App.");
+void processCommand(const String &command) {
+
+  lastSystemActivityTime = millis();
+  inactivityHandled = false;
 
-  } else if (command.startsWith("ACK:")) {
-    Serial.println("OK!");
+  if (shutdownPending) {
+    Serial.println("Shutting down, ignoring: " + command);
     return;
+  }
 
-  } else if (command.startsWith("CMD:IDENTIFY:")) {
-    String targetMacStr = command.substring(13);
-    targetMacStr.replace("-", ":");
-    String localMacStr = macToString(deviceMAC);
-
-    Serial.printf("IDENTIFY check. Target: %s, Local: %s\n", targetMacStr.c_str(), localMacStr.c_str());
-
-    if (targetMacStr.equalsIgnoreCase(localMacStr)) {
-      Serial.println("🔍 IDENTIFY MATCH — flashing LEDs");
-      for (int i = 0; i < 10; i++) {
-        fill_solid(boardLeds, NUM_LEDS_BOARD, CRGB::White);
-        fill_solid(ringLeds, NUM_LEDS_RING, CRGB::White);
-        FastLED.show();
-        delay(100);
-        FastLED.clear();
-        FastLED.show();
-        delay(100);
-      }
-    } else {
-      Serial.println("🔄 IDENTIFY not for this board — forwarding...");
-      sendData("espNow", "CMD", "IDENTIFY:" + targetMacStr);
+  const char *args;
+  const CommandEntry *entry = parseCommand(commandTable, COMMAND_COUNT, command.c_str(), &args);
+  if (entry) {
+    uint32_t start = micros();
+    entry->handler(args);
+    uint32_t elapsed = micros() - start;
+    if (elapsed > handlerMaxUs) {
+      handlerMaxUs = elapsed;
+      handlerMaxKey = entry->key;
     }
-
   } else {
     Serial.println("Unknown command: " + command);
   }
-  preferences.end();
 }
 
 void sendRestartCommand() {
   sendData("espNow", "CMD", "RESTART");
-  delay(random(300, 3000));
-  ESP.restart();
+  scheduleRestart(random(300, 3000));
+}
+
+// ---------------------- Deferred Actions ----------------------
+// Returns false when the queue is full and the action was dropped.
+bool deferAction(DeferredAction action, unsigned long delayMs) {
+  unsigned long dueAt = millis() + delayMs;
+  DeferredTask *slot = nullptr;
+
+  portENTER_CRITICAL(&deferredMux);
+  for (int i = 0; i < DEFERRED_QUEUE_LEN; i++) {
+    if (deferredQueue[i].used && deferredQueue[i].action == action) {
+      slot = &deferredQueue[i];
+      break;
+    }
+    if (!deferredQueue[i].used && !slot) slot = &deferredQueue[i];
+  }
+  if (slot) {
+    slot->used = true;
+    slot->dueAt = dueAt;
+    slot->action = action;
+  }
+  portEXIT_CRITICAL(&deferredMux);
+
+  if (!slot) Serial.println("⚠️ Deferred action queue full, action dropped");
+  return slot != nullptr;
+}
+
+// Called from loop(): runs every action that has come due.
+void serviceDeferredQueue() {
+  for (int i = 0; i < DEFERRED_QUEUE_LEN; i++) {
+    DeferredAction action = nullptr;
+
+    portENTER_CRITICAL(&deferredMux);
+    DeferredTask &t = deferredQueue[i];
+    if (t.used && (long)(millis() - t.dueAt) >= 0) {
+      action = t.action;
+      t.used = false;
+    }
+    portEXIT_CRITICAL(&deferredMux);
+
+    if (action) action();
+  }
+}
+
+void scheduleRestart(unsigned long delayMs) {
+  shutdownPending = true;
+  deferAction(restartBoard, delayMs);
+}
+
+// Blanks the strips now and sleeps after delayMs, so the messages sent just
+// before still go out.
+void scheduleDeepSleep(unsigned long delayMs) {
+  if (shutdownPending) return;
+  shutdownPending = true;
+  lockLeds();           // Held until sleep so the render task can't redraw
+  FastLED.clear(true);  // Clears all LEDs and shows black
+  deferAction(deepSleep, delayMs);
+}
+
+void endIdentify() {
+  identifying = false;
+  publishRenderSettings();
 }
 
 void sendBoardInfo() {
@@ -1022,13 +2415,7 @@ void sendBoardInfo() {
   }
   for (const auto &b : secondaryBoards) {
     char data[256];
-    sprintf(data, "r%d:%s;n%d:%s;m%d:%02x-%02x-%02x-%02x-%02x-%02x;l%d:%d;v%d:%d;ver%d:%s;",
-            b.boardNumber, b.role.c_str(),
-            b.boardNumber, b.name.c_str(),
-            b.boardNumber, b.mac[0], b.mac[1], b.mac[2], b.mac[3], b.mac[4], b.mac[5],
-            b.boardNumber, b.batteryLevel,
-            b.boardNumber, b.batteryVoltage,
-            b.boardNumber, firmwareVersion);
+    formatBoardInfo(b, data, sizeof(data));
 
     Serial.print("Sending Secondary Board info to APP: ");
     Serial.println(String(data));
@@ -1036,262 +2423,551 @@ void sendBoardInfo() {
   }
 }
 
+// One board's fields, in the form the app parses (it ends a board on "verN:").
+void formatBoardInfo(const BoardInfo &b, char *data, size_t size) {
+  snprintf(data, size, "r%d:%s;n%d:%s;m%d:%02x-%02x-%02x-%02x-%02x-%02x;l%d:%d;v%d:%d;ver%d:%s;",
+           b.boardNumber, b.role.c_str(),
+           b.boardNumber, b.name.c_str(),
+           b.boardNumber, b.mac[0], b.mac[1], b.mac[2], b.mac[3], b.mac[4], b.mac[5],
+           b.boardNumber, b.batteryLevel,
+           b.boardNumber, b.batteryVoltage,
+           b.boardNumber, b.version.c_str());
+}
+
 
 // ---------------------- BLE and ESP-NOW Callbacks ----------------------
+// Runs on the Wi-Fi task: copy the frame and get out of the way.
 void onDataRecv(const esp_now_recv_info_t *info, const uint8_t *incomingData, int len) {
-  String receivedData = String((char *)incomingData).substring(0, len);
-  memcpy(peerMAC, info->src_addr, 6);  // Always capture sender
-
-  if (receivedData == lastEspNowMessage) return;
-  lastEspNowMessage = receivedData;
+  uint32_t start = micros();
+
+  espnow_rx_frame frame;
+  frame.rxUs = start;
+  frame.kind = ESPNOW_RX_DATA;
+  memcpy(frame.mac, info->src_addr, 6);
+  frame.len = constrain(len, 0, ESP_NOW_MAX_DATA_LEN);
+  memcpy(frame.data, incomingData, frame.len);
+  if (xQueueSend(espNowRxQueue, &frame, 0) != pdTRUE) {
+    rxQueueDrops++;
+  }
 
-  // ----- ROLE NEGOTIATION MESSAGES -----
-  if (receivedData.startsWith("ROLE:")) {
-    roleMessageSeen = true;
-    setupRole = receivedData.substring(6);
+  uint32_t elapsed = micros() - start;
+  rxCallbackLastUs = elapsed;
+  if (elapsed > rxCallbackMaxUs) rxCallbackMaxUs = elapsed;
+  rxCallbackTotalUs += elapsed;
+  rxCallbackCount++;
+}
 
-    String response;
-    if (setupRole == savedRole) {
-      response = "We are both: " + savedRole;
-      Serial.println("⚠️ Conflict detected. Responded with: " + response);
+void commsTask(void *param) {
+  espnow_rx_frame frame;
+  for (;;) {
+    if (xQueueReceive(espNowRxQueue, &frame, portMAX_DELAY) != pdTRUE) continue;
+    if (frame.kind == ESPNOW_RX_DATA) {
+      handleEspNowFrame(frame.rxUs, frame.mac, frame.data, frame.len);
     } else {
-      response = "We are different roles";
-      Serial.println("👋 Received role broadcast from peer: " + setupRole);
+      handleSendStatus(frame.mac, frame.kind == ESPNOW_RX_SENT_OK);
     }
-    esp_now_send(broadcastMAC, (uint8_t *)response.c_str(), response.length());
+  }
+}
+
+void queueAppMessage(uint32_t rxUs, const uint8_t *mac, const uint8_t *data, int len) {
+  espnow_rx_frame msg;
+  msg.rxUs = rxUs;
+  msg.kind = ESPNOW_RX_DATA;
+  memcpy(msg.mac, mac, 6);
+  msg.len = len;
+  memcpy(msg.data, data, len);
+  if (xQueueSend(espNowAppQueue, &msg, 0) != pdTRUE) {
+    appQueueDrops++;
+    Serial.println("⚠️ ESP-NOW app queue full, message dropped");
+  }
+}
+
+// Runs on the comms task.
+void handleEspNowFrame(uint32_t rxUs, const uint8_t *mac, const uint8_t *incomingData, int len) {
+  if (len >= 3 && incomingData[0] == RELAY_MAGIC) {
+    handleRelayFrame(mac, incomingData, len);
     return;
   }
 
-  if (receivedData.startsWith("We are both: ")) {
-    roleMessageSeen = true;
-    setupRole = receivedData.substring(13);
-    if (setupRole == "PRIMARY") {
-      savedRole = "SECONDARY";
-      saveNewRole(savedRole);
-      Serial.println("🔧 Changed Role to: " + savedRole);
+  uint8_t session = 0;  // Unframed frames from older firmware
+  if (len >= (int)sizeof(espnow_header) && incomingData[0] == ESPNOW_MAGIC) {
+    const espnow_header *hdr = (const espnow_header *)incomingData;
+    session = hdr->session;
+    if (hdr->flags & ESPNOW_FLAG_ACK) {
+      handleEspNowAck(mac, hdr->seq);
+      return;
     }
-    return;
+    bool duplicate = isDuplicateFrame(mac, hdr->session, hdr->seq);
+    if (hdr->flags & ESPNOW_FLAG_ACK_REQ) {
+      // ACK repeats too: the sender retransmits when our first ACK was lost
+      sendEspNowAck(mac, hdr->seq);
+    }
+    if (duplicate) {
+      espNowDuplicatesDropped++;
+      return;
+    }
+    incomingData += sizeof(espnow_header);
+    len -= sizeof(espnow_header);
   }
 
-  if (receivedData.startsWith("We are different")) {
-    roleMessageSeen = true;
-    Serial.println("🛑 Role resolution complete.");
+  String receivedData;
+  receivedData.concat((const char *)incomingData, len);
+
+  // ----- ROLE ELECTION -----
+  if (receivedData.startsWith("ROLE: ")) {
+    noteRoleClaim(mac, receivedData.substring(6) == "PRIMARY", session);
     return;
   }
 
-  // ----- REGISTER NEW PEER -----
-  bool known = false;
-  for (int i = 0; i < peerCount; i++) {
-    if (memcmp(info->src_addr, knownPeers[i], 6) == 0) {
-      known = true;
-      break;
-    }
+  if (receivedData.startsWith("We are ")) {
+    return;  // Negotiation replies from older firmware; the claims decide
   }
 
-  if (!known && peerCount < MAX_PEERS) {
-    memcpy(knownPeers[peerCount], info->src_addr, 6);
-    peerCount++;
-    Serial.println("🔗 New peer: " + macToString(peerMAC));
+  // ----- REGISTER NEW PEER -----
+  portENTER_CRITICAL(&peerMux);
+  int slot = findPeerSlot(mac);
+  if (slot >= 0) peerMeta[slot].lastSeen = ++peerClock;  // RAM only; saved with the next table change
+  portEXIT_CRITICAL(&peerMux);
+
+  if (slot < 0) {
+    addKnownPeer(mac);
+    Serial.println("🔗 New peer: " + macToString(mac));
     printPeers();
+  }
 
-    esp_now_peer_info_t peerInfo = {};
-    memcpy(peerInfo.peer_addr, peerMAC, 6);
-    peerInfo.channel = 0;
-    peerInfo.encrypt = false;
-    esp_now_add_peer(&peerInfo);
+  // ----- BOARD INFO AND COMMANDS: handled by loop() -----
+  queueAppMessage(rxUs, mac, incomingData, len);
+}
+
+// Runs on loop(): board info structs and commands from peers.
+void handleEspNowMessage(const espnow_rx_frame &msg) {
+  memcpy(peerMAC, msg.mac, 6);
+
+  // Both struct sizes can also be the length of a command, so check the tag.
+  if ((msg.len == sizeof(struct_message) || msg.len == BOARD_INFO_LEGACY_LEN) &&
+      memcmp(msg.data, "SECONDARY", 10) == 0) {
+    struct_message incoming = {};
+    memcpy(&incoming, msg.data, msg.len);
+    incoming.version[sizeof(incoming.version) - 1] = '\0';
+    handleBoardMessage(incoming);
+    return;
   }
 
-  // ----- STRUCTURED BOARD MESSAGE -----
-  if (len == sizeof(struct_message)) {
-    struct_message incoming;
-    memcpy(&incoming, incomingData, sizeof(struct_message));
-
-    Serial.println("📦 Received struct_message from SECONDARY:");
-    Serial.printf("  Device: %s\n", incoming.device);
-    Serial.printf("  Name: %s\n", incoming.name);
-    Serial.printf("  MAC: %02X:%02X:%02X:%02X:%02X:%02X\n",
-                  incoming.macAddr[0], incoming.macAddr[1], incoming.macAddr[2],
-                  incoming.macAddr[3], incoming.macAddr[4], incoming.macAddr[5]);
-    Serial.printf("  Battery Level: %d%%\n", incoming.batteryLevel);
-    Serial.printf("  Battery Voltage: %dmV\n", incoming.batteryVoltage);
-
-    bool found = false;
-    for (auto &b : secondaryBoards) {
-      if (memcmp(b.mac, incoming.macAddr, 6) == 0) {
-        b.name = String(incoming.name);
-        b.batteryLevel = incoming.batteryLevel;
-        b.batteryVoltage = incoming.batteryVoltage;
-        found = true;
-        break;
-      }
+  String receivedData;
+  receivedData.concat((const char *)msg.data, msg.len);
+  Serial.println("Received data: " + receivedData);
+
+  // Forward to app if PRIMARY and not ACK
+  if (savedRole == "PRIMARY" && !receivedData.startsWith("ACK:")) {
+    sendData("app", "INFO", receivedData);
+  }
+  processCommand(receivedData);
+  recordCommandLatency(msg.rxUs);
+}
+
+void handleBoardMessage(const struct_message &incoming) {
+  Serial.println("📦 Received struct_message from SECONDARY:");
+  Serial.printf("  Device: %s\n", incoming.device);
+  Serial.printf("  Name: %s\n", incoming.name);
+  Serial.printf("  MAC: %02X:%02X:%02X:%02X:%02X:%02X\n",
+                incoming.macAddr[0], incoming.macAddr[1], incoming.macAddr[2],
+                incoming.macAddr[3], incoming.macAddr[4], incoming.macAddr[5]);
+  Serial.printf("  Battery Level: %d%%\n", incoming.batteryLevel);
+  Serial.printf("  Battery Voltage: %dmV\n", incoming.batteryVoltage);
+  Serial.printf("  Version: %s\n", incoming.version[0] ? incoming.version : "unknown");
+
+  bool found = false;
+  for (auto &b : secondaryBoards) {
+    if (memcmp(b.mac, incoming.macAddr, 6) == 0) {
+      b.name = String(incoming.name);
+      b.batteryLevel = incoming.batteryLevel;
+      b.batteryVoltage = incoming.batteryVoltage;
+      b.version = String(incoming.version);
+      found = true;
+      break;
     }
+  }
 
-    if (!found) {
-      BoardInfo newBoard;
-      String nameStr = String(incoming.name);
-      int extractedNumber = 0;
-      if (nameStr.startsWith("Board ")) {
-        extractedNumber = nameStr.substring(6).toInt();
-      }
-      if (extractedNumber == 0) {
-        extractedNumber = secondaryBoards.size() + 2;
-      }
-    const char* firmwareVersion = getFirmwareVersion();
-      newBoard.boardNumber = extractedNumber;
-      newBoard.role = "SECONDARY";
-      newBoard.name = String(incoming.name);
-      memcpy(newBoard.mac, incoming.macAddr, 6);
-      newBoard.batteryLevel = incoming.batteryLevel;
-      newBoard.batteryVoltage = incoming.batteryVoltage;
-      newBoard.version = firmwareVersion;
-      secondaryBoards.push_back(newBoard);
+  if (!found) {
+    BoardInfo newBoard;
+    String nameStr = String(incoming.name);
+    int extractedNumber = 0;
+    if (nameStr.startsWith("Board ")) {
+      extractedNumber = nameStr.substring(6).toInt();
+    }
+    if (extractedNumber == 0) {
+      extractedNumber = secondaryBoards.size() + 2;
+    }
+    newBoard.boardNumber = extractedNumber;
+    newBoard.role = "SECONDARY";
+    newBoard.name = String(incoming.name);
+    memcpy(newBoard.mac, incoming.macAddr, 6);
+    newBoard.batteryLevel = incoming.batteryLevel;
+    newBoard.batteryVoltage = incoming.batteryVoltage;
+    newBoard.version = String(incoming.version);
+    secondaryBoards.push_back(newBoard);
+  }
+
+  for (const auto &b : secondaryBoards) {
+    if (memcmp(b.mac, incoming.macAddr, 6) != 0) continue;
+    bool changed = false;
+    portENTER_CRITICAL(&peerMux);
+    int i = findPeerSlot(incoming.macAddr);
+    if (i >= 0 && (peerMeta[i].boardNumber != b.boardNumber || strncmp(peerMeta[i].name, b.name.c_str(), sizeof(peerMeta[i].name) - 1) != 0)) {
+      peerMeta[i].boardNumber = b.boardNumber;
+      strncpy(peerMeta[i].name, b.name.c_str(), sizeof(peerMeta[i].name) - 1);
+      changed = true;
     }
+    portEXIT_CRITICAL(&peerMux);
+    if (changed) markSettingDirty(SETTING_PEERS);
+  }
 
-    std::sort(secondaryBoards.begin(), secondaryBoards.end(),
-              [](const BoardInfo &a, const BoardInfo &b) {
-                return a.boardNumber < b.boardNumber;
-              });
-
-    Serial.println("📥 Updated board list:");
-    for (const auto &b : secondaryBoards) {
-      Serial.printf("  → r%d: %s [%02X:%02X:%02X:%02X:%02X:%02X], Batt: %d%%\n",
-                    b.boardNumber,
-                    b.name.c_str(),
-                    b.mac[0], b.mac[1], b.mac[2], b.mac[3], b.mac[4], b.mac[5],
-                    b.batteryLevel,
-                    b.batteryVoltage);
-
-      // Forward to app
+  std::sort(secondaryBoards.begin(), secondaryBoards.end(),
+            [](const BoardInfo &a, const BoardInfo &b) {
+              return a.boardNumber < b.boardNumber;
+            });
+
+  Serial.println("📥 Updated board list:");
+  for (const auto &b : secondaryBoards) {
+    Serial.printf("  → r%d: %s [%02X:%02X:%02X:%02X:%02X:%02X], Batt: %d%%\n",
+                  b.boardNumber,
+                  b.name.c_str(),
+                  b.mac[0], b.mac[1], b.mac[2], b.mac[3], b.mac[4], b.mac[5],
+                  b.batteryLevel,
+                  b.batteryVoltage);
+
+    // Forward only the board that answered: one notification per reply
+    if (memcmp(b.mac, incoming.macAddr, 6) == 0) {
       char data[256];
-      sprintf(data, "r%d:%s;n%d:%s;m%d:%02x:%02x:%02x:%02x:%02x:%02x;l%d:%d;v%d:%d;ver%d:%s",
-              b.boardNumber, b.role.c_str(),
-              b.boardNumber, b.name.c_str(),
-              b.boardNumber, b.mac[0], b.mac[1], b.mac[2],
-              b.mac[3], b.mac[4], b.mac[5],
-              b.boardNumber, b.batteryLevel,
-              b.boardNumber, b.batteryVoltage,
-              b.boardNumber, b.version.c_str());
+      formatBoardInfo(b, data, sizeof(data));
       updateBluetoothData(String(data));
     }
-    return;
   }
 
-  // ----- ACK -----
-  if (savedRole == "SECONDARY" && receivedData.startsWith("CMD:INFO")) {
-    String ack = "ACK: " + savedRole;
-    esp_now_send(info->src_addr, (uint8_t *)ack.c_str(), ack.length());
-    Serial.println("🔁 Responded to PRIMARY with ACK");
+  if (infoRefreshActive && ++infoRepliesReceived >= infoRepliesExpected) {
+    infoRefreshActive = false;
+    lastInfoRefreshMs = millis() - infoRequestAt;
+    Serial.printf("📋 Board list complete: %d boards in %lu ms\n",
+                  infoRepliesReceived + 1, (unsigned long)lastInfoRefreshMs);
   }
+}
 
-  // ----- PASS-THROUGH COMMAND -----
-  espNowDataBuffer = receivedData;
-  espNowDataReceived = true;
-  Serial.println("Received data: " + receivedData);
 
-  // Forward to app if PRIMARY and not ACK
-  if (savedRole == "PRIMARY" && !receivedData.startsWith("ACK:")) {
-    sendData("app", "INFO", receivedData);
+// Runs on the Wi-Fi task: hand the status to the comms task.
+void onDataSent(const uint8_t *mac_addr, esp_now_send_status_t status) {
+  if (memcmp(mac_addr, broadcastMAC, 6) == 0) return;  // Broadcasts are never ACKed, nothing to learn
+
+  espnow_rx_frame frame;
+  frame.rxUs = micros();
+  frame.kind = status == ESP_NOW_SEND_SUCCESS ? ESPNOW_RX_SENT_OK : ESPNOW_RX_SENT_FAIL;
+  memcpy(frame.mac, mac_addr, 6);
+  frame.len = 0;
+  if (xQueueSend(espNowRxQueue, &frame, 0) != pdTRUE) {
+    rxQueueDrops++;  // The backoff retries the frame anyway
   }
 }
 
-void onDataSent(const uint8_t *mac_addr, esp_now_send_status_t status) {
+// Runs on the comms task.
+void handleSendStatus(const uint8_t *mac, bool delivered) {
   Serial.print("Status of sent: ");
-  Serial.println(status == ESP_NOW_SEND_SUCCESS ? "Delivery Success" : "Delivery Fail");
-
-  if (status != ESP_NOW_SEND_SUCCESS) {
-    Serial.println("ESP-NOW Send Failed. Checking peer status...");
-    if (!esp_now_is_peer_exist(mac_addr)) {
-      Serial.println("Peer not found. Re-adding peer...");
-      esp_now_peer_info_t peerInfo;
-      memcpy(peerInfo.peer_addr, mac_addr, 6);
-      peerInfo.channel = 0;
-      peerInfo.encrypt = false;
+  Serial.println(delivered ? "Delivery Success" : "Delivery Fail");
+  if (delivered) return;
+
+  // The radio gave up on this peer; retry its pending frames now instead
+  // of waiting out the backoff
+  unsigned long now = millis();
+  portENTER_CRITICAL(&espNowTxMux);
+  PeerLinkStats *stats = linkStatsFor(mac);
+  if (stats) stats->txFail++;
+  for (int i = 0; i < ESPNOW_TX_QUEUE_LEN; i++) {
+    if (espNowTxQueue[i].used && memcmp(espNowTxQueue[i].mac, mac, 6) == 0) {
+      espNowTxQueue[i].nextRetryAt = now;
+    }
+  }
+  portEXIT_CRITICAL(&espNowTxMux);
 
-      if (esp_now_add_peer(&peerInfo) != ESP_OK) {
-        Serial.println("Failed to re-add peer");
-      } else {
-        Serial.println("Peer re-added successfully");
-      }
+  Serial.println("ESP-NOW Send Failed. Checking peer status...");
+  if (!esp_now_is_peer_exist(mac)) {
+    Serial.println("Peer not found. Re-adding peer...");
+    esp_now_peer_info_t peerInfo = {};
+    memcpy(peerInfo.peer_addr, mac, 6);
+    peerInfo.channel = 0;
+    peerInfo.encrypt = false;
+
+    if (esp_now_add_peer(&peerInfo) != ESP_OK) {
+      Serial.println("Failed to re-add peer");
+    } else {
+      Serial.println("Peer re-added successfully");
     }
   }
 }
-// ------------------------- Utility -----------------------------------
-String macToString(const uint8_t *mac) {
-  char macStr[18];
-  snprintf(macStr, sizeof(macStr), "%02X:%02X:%02X:%02X:%02X:%02X",
-           mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
-  return String(macStr);
-  Serial.print("📡 This device MAC: ");
-  Serial.println(macToString(hostMAC));
+// ---------------------- ESP-NOW Framing ----------------------
+esp_err_t espNowSend(const uint8_t *mac, const uint8_t *data, size_t len) {
+  return espNowSendFrame(mac, data, len, nextSeq(espNowTxSeq), 0);
 }
 
-// ---------------------- Communication Functions ----------------------
-void sendSettings() {
-  String data = "S:B1:" + boardName + ";COLORINDEX:" + String(colorIndex) + ";SPORTCOLOR1:" + String(sportsEffectColor1.r) + "," + String(sportsEffectColor1.g) + "," + String(sportsEffectColor1.b) + ";SPORTCOLOR2:" + String(sportsEffectColor2.r) + "," + String(sportsEffectColor2.g) + "," + String(sportsEffectColor2.b) + ";BRIGHT:" + String(brightness) + ";SIZE:" + String(blockSize) + ";SPEED:" + String(effectSpeed) + ";CELEB:" + String(irTriggerDuration) + ";TIMEOUT:" + String(inactivityTimeout) + ";DEEPSLEEP:" + String(deepSleepTimeout);
+esp_err_t espNowSendFrame(const uint8_t *mac, const uint8_t *data, size_t len, uint16_t seq, uint8_t flags) {
+  uint8_t frame[ESP_NOW_MAX_DATA_LEN];
+  if (len > ESPNOW_MAX_PAYLOAD) return ESP_ERR_INVALID_ARG;
+
+  espnow_header *hdr = (espnow_header *)frame;
+  hdr->magic = ESPNOW_MAGIC;
+  hdr->session = espNowSession;
+  hdr->flags = flags;
+  hdr->seq = seq;
+  memcpy(frame + sizeof(espnow_header), data, len);
+  return esp_now_send(mac, frame, sizeof(espnow_header) + len);
+}
 
-  // Append board names dynamically
-  for (int i = 0; i < secondaryBoards.size(); i++) {
-    data += ";B" + String(i + 2) + ":" + secondaryBoards[i].name;
+// Frees an evicted peer's stats slot for the next board.
+void forgetLinkStats(const uint8_t *mac) {
+  portENTER_CRITICAL(&espNowTxMux);
+  for (int i = 0; i < MAX_PEERS; i++) {
+    if (linkStats[i].used && memcmp(linkStats[i].mac, mac, 6) == 0) linkStats[i].used = false;
   }
+  portEXIT_CRITICAL(&espNowTxMux);
+}
 
-  if (savedRole == "PRIMARY") {
-    sendData("app", "SETTINGS", data);
+// Expects espNowTxMux to be held.
+PeerLinkStats *linkStatsFor(const uint8_t *mac) {
+  PeerLinkStats *freeSlot = nullptr;
+  for (int i = 0; i < MAX_PEERS; i++) {
+    if (linkStats[i].used && memcmp(linkStats[i].mac, mac, 6) == 0) return &linkStats[i];
+    if (!linkStats[i].used && !freeSlot) freeSlot = &linkStats[i];
+  }
+  if (freeSlot) {
+    memset(freeSlot, 0, sizeof(PeerLinkStats));
+    freeSlot->used = true;
+    memcpy(freeSlot->mac, mac, 6);
   }
+  return freeSlot;
 }
 
-void sendData(const String &device, const String &type, const String &data) {
-  if (!espNowEnabled) {
-    Serial.println("🚫 ESP-NOW not enabled! Cannot send.");
-    return;
+// Queues a unicast frame for ACKed delivery and sends the first copy.
+// Falls back to a plain send when the queue is full.
+esp_err_t espNowSendReliable(const uint8_t *mac, const uint8_t *data, size_t len, uint16_t seq) {
+  if (len > ESPNOW_MAX_PAYLOAD) return ESP_ERR_INVALID_ARG;
+
+  unsigned long now = millis();
+  bool queued = false;
+  portENTER_CRITICAL(&espNowTxMux);
+  for (int i = 0; i < ESPNOW_TX_QUEUE_LEN; i++) {
+    PendingFrame &f = espNowTxQueue[i];
+    if (f.used) continue;
+    f.used = true;
+    memcpy(f.mac, mac, 6);
+    f.seq = seq;
+    f.len = len;
+    f.attempts = 1;
+    f.firstSentAt = now;
+    f.nextRetryAt = now + ESPNOW_RETRY_BASE_MS;
+    memcpy(f.payload, data, len);
+    queued = true;
+    break;
   }
+  PeerLinkStats *stats = linkStatsFor(mac);
+  if (stats) stats->sent++;
+  portEXIT_CRITICAL(&espNowTxMux);
 
-  char messageBuffer[250];
-  String currentMessage;
+  if (!queued) Serial.println("⚠️ ESP-NOW TX queue full, sending without ACK");
+  return espNowSendFrame(mac, data, len, seq, queued ? ESPNOW_FLAG_ACK_REQ : 0);
+}
 
-  if (device == "espNow") {
-    Serial.println(data.c_str());
-    snprintf(messageBuffer, sizeof(messageBuffer), "%s:%s", type.c_str(), data.c_str());
-    currentMessage = String(messageBuffer);
-
-    // Show what we're trying to send
-    Serial.println("📤 sendData(espNow): " + currentMessage);
-    Serial.println("🔎 Known Peers: " + String(peerCount));
+void sendEspNowAck(const uint8_t *mac, uint16_t seq) {
+  if (!esp_now_is_peer_exist(mac)) {
+    esp_now_peer_info_t peerInfo = {};
+    memcpy(peerInfo.peer_addr, mac, 6);
+    peerInfo.channel = 0;
+    peerInfo.encrypt = false;
+    esp_now_add_peer(&peerInfo);
+  }
+  espNowSendFrame(mac, nullptr, 0, seq, ESPNOW_FLAG_ACK);
+}
 
-    // If it's a duplicate, skip
-    if (currentMessage == lastEspNowMessage) {
-      Serial.println("⚠️ Duplicate ESP-NOW message detected. Skipping send.");
-      return;
+void handleEspNowAck(const uint8_t *mac, uint16_t seq) {
+  unsigned long now = millis();
+  portENTER_CRITICAL(&espNowTxMux);
+  for (int i = 0; i < ESPNOW_TX_QUEUE_LEN; i++) {
+    PendingFrame &f = espNowTxQueue[i];
+    if (!f.used || f.seq != seq || memcmp(f.mac, mac, 6) != 0) continue;
+    f.used = false;
+    PeerLinkStats *stats = linkStatsFor(mac);
+    if (stats) {
+      uint32_t rtt = now - f.firstSentAt;
+      stats->acked++;
+      stats->rttLastMs = rtt;
+      stats->rttAvgMs = stats->acked == 1 ? rtt : (stats->rttAvgMs * 7 + rtt) / 8;
     }
+    break;
+  }
+  portEXIT_CRITICAL(&espNowTxMux);
 
-    bool sent = false;
+  uint32_t none = 0;
+  if (firstUnicastAckUs.compare_exchange_strong(none, (uint32_t)esp_timer_get_time())) {
+    Serial.printf("⏱️ First unicast delivery %lu ms after boot\n", (unsigned long)(firstUnicastAckUs.load() / 1000));
+  }
+}
 
-    // Send to all known peers
-    for (int i = 0; i < peerCount; i++) {
-      if (!esp_now_is_peer_exist(knownPeers[i])) {
-        Serial.println("🔁 Peer not found. Trying to re-add: " + macToString(knownPeers[i]));
-        esp_now_peer_info_t peerInfo = {};
-        memcpy(peerInfo.peer_addr, knownPeers[i], 6);
-        peerInfo.channel = 0;
-        peerInfo.encrypt = false;
-        esp_now_add_peer(&peerInfo);
-      }
+// Called from loop(): retransmits frames whose backoff expired and retires
+// the ones that ran out of attempts.
+void serviceEspNowQueue() {
+  uint8_t payload[ESPNOW_MAX_PAYLOAD];
+  uint8_t mac[6];
 
-      esp_err_t result = esp_now_send(knownPeers[i], (uint8_t *)currentMessage.c_str(), currentMessage.length());
-      Serial.printf("📡 Sent to %s: %s %s\n",
-                    macToString(knownPeers[i]).c_str(),
-                    currentMessage.c_str(),
-                    result == ESP_OK ? "✅" : "❌");
+  for (int i = 0; i < ESPNOW_TX_QUEUE_LEN; i++) {
+    unsigned long now = millis();
+    bool resend = false;
+    uint16_t seq = 0;
+    uint8_t len = 0;
+
+    portENTER_CRITICAL(&espNowTxMux);
+    PendingFrame &f = espNowTxQueue[i];
+    if (f.used && (long)(now - f.nextRetryAt) >= 0) {
+      PeerLinkStats *stats = linkStatsFor(f.mac);
+      if (f.attempts >= ESPNOW_MAX_ATTEMPTS) {
+        f.used = false;
+        if (stats) stats->lost++;
+      } else {
+        f.attempts++;
+        f.nextRetryAt = now + (ESPNOW_RETRY_BASE_MS << f.attempts);
+        if (stats) stats->retries++;
+        memcpy(mac, f.mac, 6);
+        memcpy(payload, f.payload, f.len);
+        seq = f.seq;
+        len = f.len;
+        resend = true;
+      }
+    }
+    portEXIT_CRITICAL(&espNowTxMux);
 
-      if (result == ESP_OK) sent = true;
+    if (resend) {
+      espNowSendFrame(mac, payload, len, seq, ESPNOW_FLAG_ACK_REQ);
     }
+  }
+}
 
-    // Fallback to broadcast if nothing was sent or no peers
-    if (!sent || peerCount == 0) {
-      Serial.println("📡 No peers or failed sends. Broadcasting message.");
-      esp_now_send(broadcastMAC, (uint8_t *)currentMessage.c_str(), currentMessage.length());
+// Sends the message to every known peer with ACKed delivery, or broadcasts
+// it when no peer is known or every unicast failed. One sequence number is
+// used throughout, so a peer that hears both copies only acts once.
+bool sendToPeers(const uint8_t *data, size_t len) {
+  uint16_t seq = nextSeq(espNowTxSeq);
+  bool sent = false;
+  uint8_t peers[MAX_PEERS][6];
+  int count = copyKnownPeers(peers);
+
+  for (int i = 0; i < count; i++) {
+    if (!esp_now_is_peer_exist(peers[i])) {
+      Serial.println("🔁 Peer not found. Trying to re-add: " + macToString(peers[i]));
+      esp_now_peer_info_t peerInfo = {};
+      memcpy(peerInfo.peer_addr, peers[i], 6);
+      peerInfo.channel = 0;
+      peerInfo.encrypt = false;
+      esp_now_add_peer(&peerInfo);
     }
 
-    lastEspNowMessage = currentMessage;
+    esp_err_t result = espNowSendReliable(peers[i], data, len, seq);
+    Serial.printf("📡 Sent to %s: %.*s %s\n",
+                  macToString(peers[i]).c_str(),
+                  (int)len, (const char *)data,
+                  result == ESP_OK ? "✅" : "❌");
+
+    if (result == ESP_OK) sent = true;
+  }
+
+  // Fallback to broadcast if nothing was sent or no peers
+  if (!sent || count == 0) {
+    broadcastFallbacks++;
+    Serial.println("📡 No peers or failed sends. Broadcasting message.");
+    sent = espNowSendFrame(broadcastMAC, data, len, seq, 0) == ESP_OK;
+  }
+  return sent;
+}
+
+void sendLinkStats() {
+  char data[160];
+
+  uint32_t count = rxCallbackCount;
+  snprintf(data, sizeof(data),
+           "ESPNOW_RX:cb_last_us=%lu,cb_max_us=%lu,cb_avg_us=%lu,frames=%lu,rx_drops=%lu,app_drops=%lu,dups=%lu;",
+           (unsigned long)rxCallbackLastUs, (unsigned long)rxCallbackMaxUs,
+           (unsigned long)(count ? rxCallbackTotalUs / count : 0), (unsigned long)count,
+           (unsigned long)rxQueueDrops, (unsigned long)appQueueDrops, (unsigned long)espNowDuplicatesDropped);
+  Serial.println(data);
+  updateBluetoothData(String(data));
+  snprintf(data, sizeof(data), "PEERS:known=%d,first_unicast_ms=%lu,broadcast_fallbacks=%lu;",
+           peerCount, (unsigned long)(firstUnicastAckUs.load() / 1000), (unsigned long)broadcastFallbacks);
+  Serial.println(data);
+  updateBluetoothData(String(data));
+  if (deviceRole == PRIMARY) {
+    snprintf(data, sizeof(data), "INFO_REFRESH:last_ms=%lu,replies=%d/%d,slot_ms=%d;",
+             (unsigned long)lastInfoRefreshMs, infoRepliesReceived, infoRepliesExpected, INFO_SLOT_MS);
+    Serial.println(data);
+    updateBluetoothData(String(data));
+  }
+  for (int i = 0; i < MAX_PEERS; i++) {
+    portENTER_CRITICAL(&espNowTxMux);
+    PeerLinkStats stats = linkStats[i];
+    portEXIT_CRITICAL(&espNowTxMux);
+    if (!stats.used) continue;
+
+    snprintf(data, sizeof(data),
+             "LINK:%02x-%02x-%02x-%02x-%02x-%02x,sent=%lu,acked=%lu,retries=%lu,lost=%lu,txfail=%lu,rtt=%lu,rttavg=%lu;",
+             stats.mac[0], stats.mac[1], stats.mac[2], stats.mac[3], stats.mac[4], stats.mac[5],
+             (unsigned long)stats.sent, (unsigned long)stats.acked, (unsigned long)stats.retries,
+             (unsigned long)stats.lost, (unsigned long)stats.txFail,
+             (unsigned long)stats.rttLastMs, (unsigned long)stats.rttAvgMs);
+    Serial.println(data);
+    updateBluetoothData(String(data));
+  }
+}
+
+bool isDuplicateFrame(const uint8_t *mac, uint8_t session, uint16_t seq) {
+  return isDuplicateSeq(seqWindows, MAX_PEERS, mac, session, seq, millis());
+}
+
+// ------------------------- Utility -----------------------------------
+String macToString(const uint8_t *mac) {
+  char macStr[18];
+  snprintf(macStr, sizeof(macStr), "%02X:%02X:%02X:%02X:%02X:%02X",
+           mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+  return String(macStr);
+  Serial.print("📡 This device MAC: ");
+  Serial.println(macToString(hostMAC));
+}
+
+// ---------------------- Communication Functions ----------------------
+void sendSettings() {
+  String data = "S:B1:" + boardName + ";COLORINDEX:" + String(colorIndex) + ";SPORTCOLOR1:" + String(sportsEffectColor1.r) + "," + String(sportsEffectColor1.g) + "," + String(sportsEffectColor1.b) + ";SPORTCOLOR2:" + String(sportsEffectColor2.r) + "," + String(sportsEffectColor2.g) + "," + String(sportsEffectColor2.b) + ";BRIGHT:" + String(brightness) + ";SIZE:" + String(blockSize) + ";SPEED:" + String(effectSpeed) + ";CELEB:" + String(irTriggerDuration) + ";TIMEOUT:" + String(inactivityTimeout) + ";DEEPSLEEP:" + String(deepSleepTimeout);
+
+  // Append board names dynamically
+  for (int i = 0; i < secondaryBoards.size(); i++) {
+    data += ";B" + String(i + 2) + ":" + secondaryBoards[i].name;
+  }
+
+  if (savedRole == "PRIMARY") {
+    sendData("app", "SETTINGS", data);
+  }
+}
+
+void sendData(const String &device, const String &type, const String &data) {
+  if (!espNowEnabled) {
+    Serial.println("🚫 ESP-NOW not enabled! Cannot send.");
+    return;
+  }
+
+  char messageBuffer[ESPNOW_MAX_PAYLOAD];
+  String currentMessage;
+
+  if (device == "espNow") {
+    Serial.println(data.c_str());
+    snprintf(messageBuffer, sizeof(messageBuffer), "%s:%s", type.c_str(), data.c_str());
+    currentMessage = String(messageBuffer);
+
+    // Show what we're trying to send
+    Serial.println("📤 sendData(espNow): " + currentMessage);
+    Serial.println("🔎 Known Peers: " + String(peerCount));
+
+    sendToPeers((const uint8_t *)currentMessage.c_str(), currentMessage.length());
   }
 
   else if (device == "app" && deviceRole == PRIMARY) {
@@ -1315,25 +2991,72 @@ void sendData(const String &device, const String &type, const String &data) {
   }
 }
 
+// Never blocks: queues the message for the bleTx task, split into
+// BLE_NOTIFY_MAX_LEN pieces if needed.
 void updateBluetoothData(String data) {
-  if (deviceRole != PRIMARY || pCharacteristic == nullptr) return;  // Prevent crash
+  if (deviceRole != PRIMARY || pCharacteristic == nullptr || bleNotifyQueue == NULL) return;  // Prevent crash
+
+  ble_notify_msg msg;
+  for (size_t pos = 0; pos < data.length(); pos += BLE_NOTIFY_MAX_LEN) {
+    msg.len = min((size_t)BLE_NOTIFY_MAX_LEN, data.length() - pos);
+    memcpy(msg.data, data.c_str() + pos, msg.len);
+    if (xQueueSend(bleNotifyQueue, &msg, 0) != pdTRUE) {
+      bleNotifyDrops++;
+      return;
+    }
+  }
+}
 
-  const int maxChunkSize = 512;                                            // Maximum BLE payload size is 20 bytes
-  String message = data;                                                   // Full message to send
-  int totalChunks = (message.length() + maxChunkSize - 1) / maxChunkSize;  // Total number of chunks
+// OTA credits are sent ahead of each queued message, and on an idle
+// timeout so a grant made while disconnected goes out after reconnecting.
+void bleTxTask(void *param) {
+  ble_notify_msg msg;
+  for (;;) {
+    bool received = xQueueReceive(bleNotifyQueue, &msg, pdMS_TO_TICKS(BLE_TX_IDLE_MS)) == pdTRUE;
+    if (!deviceConnected) continue;  // Nobody to tell
+    flushOtaCredits();
+    if (received && msg.len > 0) bleNotify(msg.data, msg.len);
+  }
+}
 
-  for (int i = 0; i < totalChunks; i++) {
-    int startIdx = i * maxChunkSize;
-    int endIdx = min(startIdx + maxChunkSize, (int)message.length());  // Cast message.length() to int
+// Runs on bleTx: one notification, in frames of the negotiated MTU.
+void bleNotify(const char *data, size_t len) {
+  uint32_t start = micros();
+  size_t frameLen = max(1, bleMtu.load() - BLE_ATT_HEADER_LEN);
+  for (size_t pos = 0; pos < len && deviceConnected; pos += frameLen) {
+    while (bleCongested && deviceConnected) {
+      bleTxCongestedWaits++;
+      vTaskDelay(pdMS_TO_TICKS(2));
+    }
+    size_t n = min(frameLen, len - pos);
+    pCharacteristic->setValue((uint8_t *)data + pos, n);
+    pCharacteristic->notify();
+    bleTxBytes += n;
+    bleTxFrames++;
+    vTaskDelay(1);  // Let the stack hand the frame to the controller
+  }
+  bleTxBusyUs += micros() - start;
+}
 
-    String chunk = message.substring(startIdx, endIdx);
-    // Send the chunk instead of the entire message
-    pCharacteristic->setValue(chunk.c_str());  // Convert String to C-string for BLE transmission
-    pCharacteristic->notify();                 // Send the chunk via BLE notification
-    delay(20);                                 // Delay to avoid congestion
+// Runs on the BLE stack task alongside the library's own handler.
+void bleGattsEvent(esp_gatts_cb_event_t event, esp_gatt_if_t gattsIf, esp_ble_gatts_cb_param_t *param) {
+  if (event == ESP_GATTS_CONGEST_EVT) {
+    bleCongested = param->congest.congested;
   }
 }
 
+void sendBleStats() {
+  uint32_t bytesPerSec = bleTxBusyUs ? (uint32_t)((uint64_t)bleTxBytes * 1000000 / bleTxBusyUs) : 0;
+  char data[200];
+  snprintf(data, sizeof(data),
+           "BLE:mtu=%u,queued=%lu,frames=%lu,bytes=%lu,bytes_per_s=%lu,congested_waits=%lu,drops=%lu;",
+           bleMtu.load(), (unsigned long)(bleNotifyQueue ? uxQueueMessagesWaiting(bleNotifyQueue) : 0),
+           (unsigned long)bleTxFrames, (unsigned long)bleTxBytes, (unsigned long)bytesPerSec,
+           (unsigned long)bleTxCongestedWaits, (unsigned long)bleNotifyDrops.load());
+  Serial.println(data);
+  updateBluetoothData(String(data));
+}
+
 // ---------------------- Button Callback Functions ----------------------
 void singleClick() {
   if (!lightsOn) {
@@ -1342,7 +3065,7 @@ void singleClick() {
   }
   colorIndex = (colorIndex + 1) % (sizeof(colors) / sizeof(colors[0]));
   currentColor = colors[colorIndex];
-  ledEffects.setColor(currentColor);
+  publishRenderSettings();
   sendData("espNow", "ColorIndex", String(colorIndex));
   if (deviceRole == PRIMARY) {
     sendData("app", "ColorIndex", String(colorIndex));
@@ -1359,7 +3082,7 @@ void doubleClick() {
     return;
   }
   effectIndex = (effectIndex + 1) % (sizeof(effects) / sizeof(effects[0]));
-  ledEffects.applyEffect(effects[effectIndex]);
+  publishRenderSettings();
   sendData("espNow", "Effect", effects[effectIndex]);
   if (deviceRole == PRIMARY) {
     sendData("app", "Effect", effects[effectIndex]);
@@ -1378,10 +3101,7 @@ void longPress() {
     sendData("app", "CMD", "SLEEP");
   }
 
-  FastLED.clear(true);  // Clears all LEDs and shows black
-  delay(100);           // Ensure it gets shown before sleeping    delay(100);  // allow message to print
-  deepSleep();
-  return;
+  scheduleDeepSleep(100);
 }
 
 // ---------------------- Utility Functions ----------------------
@@ -1389,7 +3109,7 @@ void longPress() {
 void toggleLights(bool status) {
   lightsOn = status;
   if (status) lastUserActivityTime = millis();
-  ledEffects.setColor(lightsOn ? currentColor : CRGB::Black);  // Set color if on, black if off
+  publishRenderSettings();  // Render task sets black when off
   String message = String(status ? "on" : "off");
 
   Serial.print("Lights are: ");
@@ -1400,8 +3120,7 @@ void toggleEspNow(bool status) {
   espNowEnabled = status;
   if (espNowEnabled) {
     Serial.println("ESP-NOW enabled");
-    esp_now_deinit();  // Ensure clean reinit
-    setupEspNow();
+    restartEspNow();
   } else {
     Serial.println("ESP-NOW disabled");
     esp_now_deinit();
@@ -1419,8 +3138,7 @@ void btPairing() {
     deviceConnected = true;
 
     if (pCharacteristic && pServer->getConnectedCount() > 0) {
-      delay(1000);      // optional stability delay
-      sendBoardInfo();  // ✅ Send board info to app on BLE connection
+      deferAction(sendBoardInfo, 1000);  // ✅ Send board info to app once the link settles
       Serial.println("Bluetooth Device paired successfully");
     } else {
       Serial.println("⚠️ BLE device connected, but characteristic not ready.");
@@ -1428,15 +3146,13 @@ void btPairing() {
   }
 }
 
+// Starts and ends the celebration overlay; the render task draws it.
 void handleIRSensor() {
   int reading = digitalRead(SENSOR_PIN);
-  static bool effectRunning = false;
-  static unsigned long effectStartTime = 0;
-  const unsigned long effectDuration = irTriggerDuration;
 
-  if (reading == LOW && !effectRunning) {
-    effectStartTime = millis();
-    effectRunning = true;
+  if (reading == LOW && !celebrating) {
+    celebrationStartTime = millis();
+    celebrating = true;
     irTriggered = true;
 
     // Turn lights on if they were off
@@ -1450,25 +3166,22 @@ void handleIRSensor() {
       Serial.println("IR Trigger: Lights were off — turning on.");
     }
 
-    ledEffects.celebrationEffect();
+    publishRenderSettings();
     Serial.println("IR Sensor Triggered: Celebration Effect Started");
-
-    while (millis() - effectStartTime < effectDuration) {
-      ledEffects.celebrationEffect();
-      delay(20);  // adjust to match animation frame rate
-    }
   }
 
-  if (effectRunning && (millis() - effectStartTime >= effectDuration)) {
-    effectRunning = false;
+  if (celebrating && (millis() - celebrationStartTime >= irTriggerDuration)) {
+    celebrating = false;
     irTriggered = false;
-    ledEffects.setColor(currentColor);
+    publishRenderSettings();
     Serial.println("IR Sensor Triggered: Celebration Effect Ended");
   }
   lastUserActivityTime = millis();
 }
 
 void deepSleep() {
+  flushSettings();
+  saveRtcState();
   WiFi.disconnect(true);
   //WiFi.mode(WIFI_OFF);
 
@@ -1501,6 +3214,402 @@ int getEffectIndex(String effect) {
   return 0;
 }
 
+// ---------------------- Render Task ----------------------
+void publishRenderSettings() {
+  render_settings next;
+  next.effectIndex = effectIndex;
+  next.lightsOn = lightsOn;
+  next.brightness = brightness;
+  next.blockSize = blockSize;
+  next.effectSpeed = effectSpeed;
+  next.color = lightsOn ? currentColor : CRGB(CRGB::Black);
+  next.initialColor = initialColor;
+  next.sportsColor1 = sportsEffectColor1;
+  next.sportsColor2 = sportsEffectColor2;
+  next.celebrate = celebrating;
+  next.identify = identifying;
+  next.identifyStartMs = identifyStartTime;
+
+  portENTER_CRITICAL(&renderMux);
+  renderShared = next;
+  renderSettingsVersion++;
+  portEXIT_CRITICAL(&renderMux);
+}
+
+// For LED writes from outside the render task.
+void lockLeds() {
+  xSemaphoreTake(ledMutex, portMAX_DELAY);
+}
+
+void unlockLeds() {
+  renderForceRedraw = true;  // The strips no longer show the last rendered frame
+  xSemaphoreGive(ledMutex);
+}
+
+uint32_t frameHash() {
+  uint32_t hash = 2166136261UL;  // FNV-1a
+  const uint8_t *p = (const uint8_t *)ringLeds;
+  for (size_t i = 0; i < sizeof(ringLeds); i++) hash = (hash ^ p[i]) * 16777619UL;
+  p = (const uint8_t *)boardLeds;
+  for (size_t i = 0; i < sizeof(boardLeds); i++) hash = (hash ^ p[i]) * 16777619UL;
+  return (hash ^ FastLED.getBrightness()) * 16777619UL;
+}
+
+// Push whatever changed since the last snapshot into the effects library.
+void applyRenderSettings(const render_settings &next, render_settings &applied, bool force) {
+  if (force || next.brightness != applied.brightness) ledEffects.setBrightness(next.brightness);
+  if (force || next.blockSize != applied.blockSize) ledEffects.setBlockSize(next.blockSize);
+  if (force || next.effectSpeed != applied.effectSpeed) ledEffects.setEffectSpeed(next.effectSpeed);
+  if (force || next.initialColor != applied.initialColor) ledEffects.setInitialColor(next.initialColor);
+  if (force || next.color != applied.color) ledEffects.setColor(next.color);
+  if (force || next.sportsColor1 != applied.sportsColor1 || next.sportsColor2 != applied.sportsColor2) {
+    ledEffects.setSportsEffectColors(next.sportsColor1, next.sportsColor2);
+  }
+  applied = next;
+}
+
+void perfRecord(perf_histogram &h, uint32_t us) {
+  int bucket = 0;
+  while (bucket < PERF_BUCKETS - 1 && us > perfBucketLimitsUs[bucket]) bucket++;
+
+  if (h.count >= PERF_HIST_AGE_COUNT) {
+    for (int i = 0; i < PERF_BUCKETS; i++) h.buckets[i] /= 2;
+    h.count /= 2;
+    h.totalUs /= 2;
+  }
+  h.buckets[bucket]++;
+  h.count++;
+  h.totalUs += us;
+  h.lastUs = us;
+  if (us > h.maxUs) h.maxUs = us;
+}
+
+void renderTask(void *param) {
+  render_settings applied = {};
+  uint32_t appliedVersion = 0;
+  bool firstFrame = true;
+
+  TickType_t lastWake = xTaskGetTickCount();
+  uint32_t lastFrameStart = micros();
+  uint32_t windowStart = millis();
+  uint32_t windowFrames = 0;
+  uint32_t windowJitterSum = 0;
+  uint32_t windowJitterMax = 0;
+  uint32_t windowDrawSum = 0;
+  uint32_t windowDrawMax = 0;
+  uint32_t overruns = 0;
+  uint32_t lastFrameEnd = micros();
+  uint32_t drawnFrames = 0;
+  uint32_t cyclesPerUs = ESP.getCpuFreqMHz();
+
+  uint32_t lastHash = 0;
+  uint32_t lastChangeMs = 0;
+  uint32_t lastDrawMs = 0;
+  bool frameStatic = false;
+  uint32_t elidedFrames = 0;
+  uint32_t darkFrames = 0;
+  uint32_t lastCelebrationStepMs = 0;
+  int32_t identifyPhase = -1;
+
+  if (powerOnEffectPending) {
+    xSemaphoreTake(ledMutex, portMAX_DELAY);
+    ledEffects.powerOnEffect();
+    fill_solid(ringLeds, NUM_LEDS_RING, deviceRole == PRIMARY ? CRGB::Blue : CRGB::Red);  // Blue = primary, red = secondary
+    FastLED.show();
+    xSemaphoreGive(ledMutex);
+    powerOnEffectPending = false;
+    lastWake = xTaskGetTickCount();
+  }
+
+  for (;;) {
+    int fps = renderFps;
+    TickType_t periodTicks = pdMS_TO_TICKS(1000 / fps);
+    if (periodTicks == 0) periodTicks = 1;
+    vTaskDelayUntil(&lastWake, periodTicks);
+
+    uint32_t frameStart = micros();
+    uint32_t periodUs = periodTicks * portTICK_PERIOD_MS * 1000UL;
+    uint32_t interval = frameStart - lastFrameStart;
+    uint32_t jitter = interval > periodUs ? interval - periodUs : periodUs - interval;
+    lastFrameStart = frameStart;
+
+    render_settings next;
+    uint32_t version;
+    portENTER_CRITICAL(&renderMux);
+    next = renderShared;
+    version = renderSettingsVersion;
+    portEXIT_CRITICAL(&renderMux);
+
+    uint32_t idleUs = frameStart - lastFrameEnd;
+    uint32_t effectUs = 0;
+    uint32_t showUs = 0;
+    uint32_t celebrationUs = 0;
+    bool drawn = false;
+    bool celebrationDrawn = false;
+
+    if (!otaInProgress) {
+      xSemaphoreTake(ledMutex, portMAX_DELAY);
+      uint32_t nowMs = millis();
+      if (firstFrame || version != appliedVersion) {
+        applyRenderSettings(next, applied, firstFrame);
+        appliedVersion = version;
+        firstFrame = false;
+        frameStatic = false;
+        lastChangeMs = nowMs;
+        identifyPhase = -1;
+      }
+      if (renderForceRedraw.exchange(false)) {
+        frameStatic = false;
+        lastChangeMs = nowMs;
+      }
+      if (frameStatic && nowMs - lastDrawMs >= RENDER_KEEPALIVE_MS) {
+        frameStatic = false;  // Draw once; stays static below if nothing moved
+      }
+
+      if (next.identify) {
+        // Even half-periods white, odd ones black; only redrawn on a change
+        int32_t phase = (nowMs - next.identifyStartMs) / IDENTIFY_HALF_PERIOD_MS;
+        if (phase != identifyPhase) {
+          CRGB color = (phase % 2 == 0) ? CRGB::White : CRGB::Black;
+          fill_solid(boardLeds, NUM_LEDS_BOARD, color);
+          fill_solid(ringLeds, NUM_LEDS_RING, color);
+          FastLED.show();
+          identifyPhase = phase;
+          lastDrawMs = nowMs;
+        }
+      } else if (!next.lightsOn) {
+        darkFrames++;
+      } else if (next.celebrate) {
+        // Animated throughout; the version bump when it ends restarts the effect
+        if (nowMs - lastCelebrationStepMs >= CELEBRATION_STEP_MS) {
+          uint32_t c0 = ESP.getCycleCount();
+          ledEffects.celebrationEffect();
+          celebrationUs = (ESP.getCycleCount() - c0) / cyclesPerUs;
+          celebrationDrawn = true;
+          lastCelebrationStepMs = nowMs;
+          lastDrawMs = nowMs;
+        }
+      } else if (frameStatic) {
+        elidedFrames++;
+      } else {
+        uint32_t c0 = ESP.getCycleCount();
+        ledEffects.applyEffect(effects[next.effectIndex]);
+        uint32_t c1 = ESP.getCycleCount();
+        effectUs = (c1 - c0) / cyclesPerUs;
+
+        if (drawnFrames % PERF_SHOW_SAMPLE_FRAMES == 0) {
+          FastLED.show();  // Same pixels again: timing only, nothing visible changes
+          showUs = (ESP.getCycleCount() - c1) / cyclesPerUs;
+        }
+        drawnFrames++;
+        drawn = true;
+        lastDrawMs = nowMs;
+
+        uint32_t hash = frameHash();
+        uint32_t holdMs = max((unsigned long)RENDER_STATIC_HOLD_MS, next.effectSpeed * 8);
+        if (hash != lastHash) {
+          lastHash = hash;
+          lastChangeMs = nowMs;
+        } else if (nowMs - lastChangeMs >= holdMs) {
+          frameStatic = true;
+        }
+      }
+      xSemaphoreGive(ledMutex);
+    } else {
+      darkFrames++;
+    }
+
+    portENTER_CRITICAL(&renderMux);
+    perfRecord(perfIdle, idleUs);
+    if (showUs) {
+      perfShowSampleUs = showUs;
+      perfRecord(perfShow, showUs);
+    }
+    if (drawn) {
+      uint32_t computeUs = effectUs > perfShowSampleUs ? effectUs - perfShowSampleUs : 0;
+      perfRecord(perfCompute[next.effectIndex], computeUs);
+    }
+    if (celebrationDrawn) perfRecord(perfCelebration, celebrationUs);
+    portEXIT_CRITICAL(&renderMux);
+
+    lastFrameEnd = micros();
+    uint32_t drawUs = lastFrameEnd - frameStart;
+    if (drawUs > periodUs) overruns++;
+
+    windowFrames++;
+    windowJitterSum += jitter;
+    if (jitter > windowJitterMax) windowJitterMax = jitter;
+    windowDrawSum += drawUs;
+    if (drawUs > windowDrawMax) windowDrawMax = drawUs;
+
+    uint32_t elapsedMs = millis() - windowStart;
+    if (elapsedMs >= RENDER_STATS_WINDOW_MS) {
+      render_stats stats;
+      stats.fpsX10 = windowFrames * 10000UL / elapsedMs;
+      stats.jitterAvgUs = windowJitterSum / windowFrames;
+      stats.jitterMaxUs = windowJitterMax;
+      stats.frameAvgUs = windowDrawSum / windowFrames;
+      stats.frameMaxUs = windowDrawMax;
+      stats.overruns = overruns;
+      stats.framesDrawn = drawnFrames;
+      stats.framesElided = elidedFrames;
+      stats.framesDark = darkFrames;
+
+      portENTER_CRITICAL(&renderMux);
+      renderStats = stats;
+      portEXIT_CRITICAL(&renderMux);
+
+      windowStart += elapsedMs;
+      windowFrames = 0;
+      windowJitterSum = 0;
+      windowJitterMax = 0;
+      windowDrawSum = 0;
+      windowDrawMax = 0;
+    }
+  }
+}
+
+void sendRenderStats() {
+  render_stats stats;
+  portENTER_CRITICAL(&renderMux);
+  stats = renderStats;
+  portEXIT_CRITICAL(&renderMux);
+
+  // Push time saved, estimated from the latest show() sample
+  uint32_t savedMs = (uint32_t)((uint64_t)(stats.framesElided + stats.framesDark) * perfShowSampleUs / 1000);
+
+  char data[256];
+  snprintf(data, sizeof(data),
+           "RENDER:target=%d,fps=%lu.%lu,jitter_avg_us=%lu,jitter_max_us=%lu,frame_avg_us=%lu,frame_max_us=%lu,overruns=%lu,"
+           "drawn=%lu,elided=%lu,dark=%lu,show_saved_ms=%lu;",
+           renderFps, (unsigned long)(stats.fpsX10 / 10), (unsigned long)(stats.fpsX10 % 10),
+           (unsigned long)stats.jitterAvgUs, (unsigned long)stats.jitterMaxUs,
+           (unsigned long)stats.frameAvgUs, (unsigned long)stats.frameMaxUs,
+           (unsigned long)stats.overruns, (unsigned long)stats.framesDrawn,
+           (unsigned long)stats.framesElided, (unsigned long)stats.framesDark, (unsigned long)savedMs);
+  Serial.println(data);
+  updateBluetoothData(String(data));
+}
+
+void resetPerfStats() {
+  portENTER_CRITICAL(&renderMux);
+  memset(perfCompute, 0, sizeof(perfCompute));
+  memset(&perfShow, 0, sizeof(perfShow));
+  memset(&perfIdle, 0, sizeof(perfIdle));
+  memset(&perfCelebration, 0, sizeof(perfCelebration));
+  memset(&perfCommand, 0, sizeof(perfCommand));
+  memset(&perfCommandCeleb, 0, sizeof(perfCommandCeleb));
+  memset(&perfLoop, 0, sizeof(perfLoop));
+  portEXIT_CRITICAL(&renderMux);
+  loopMaxUs = 0;
+  loopStalls = 0;
+  handlerMaxUs = 0;
+  handlerMaxKey = "";
+}
+
+// Called from loop() once a command's handler has returned.
+void recordCommandLatency(uint32_t sinceUs) {
+  uint32_t us = micros() - sinceUs;
+  portENTER_CRITICAL(&renderMux);
+  perfRecord(celebrating ? perfCommandCeleb : perfCommand, us);
+  portEXIT_CRITICAL(&renderMux);
+}
+
+void sendPerfLine(const char *name, const perf_histogram &h) {
+  char data[200];
+  int n = snprintf(data, sizeof(data), "PERF:%s,n=%lu,last_us=%lu,avg_us=%lu,max_us=%lu,hist=",
+                   name, (unsigned long)h.count, (unsigned long)h.lastUs,
+                   (unsigned long)(h.count ? h.totalUs / h.count : 0), (unsigned long)h.maxUs);
+  for (int i = 0; i < PERF_BUCKETS && n < (int)sizeof(data); i++) {
+    n += snprintf(data + n, sizeof(data) - n, i ? "/%lu" : "%lu", (unsigned long)h.buckets[i]);
+  }
+  if (n < (int)sizeof(data) - 1) strcat(data, ";");
+  Serial.println(data);
+  updateBluetoothData(String(data));
+}
+
+// One line per histogram: effects that have rendered, then show and idle,
+// then command latency outside and during celebrations, then loop() time.
+// A last STALL: line has the worst loop() iteration and command handler.
+void sendPerfStats() {
+  perf_histogram compute[EFFECT_COUNT];
+  perf_histogram show;
+  perf_histogram idle;
+  perf_histogram celebration;
+  perf_histogram command;
+  perf_histogram commandCeleb;
+  perf_histogram loopTime;
+  portENTER_CRITICAL(&renderMux);
+  memcpy(compute, perfCompute, sizeof(compute));
+  show = perfShow;
+  idle = perfIdle;
+  celebration = perfCelebration;
+  command = perfCommand;
+  commandCeleb = perfCommandCeleb;
+  loopTime = perfLoop;
+  portEXIT_CRITICAL(&renderMux);
+
+  char data[160];
+  int n = snprintf(data, sizeof(data), "PERF:buckets_us=");
+  for (int i = 0; i < PERF_BUCKETS - 1; i++) {
+    n += snprintf(data + n, sizeof(data) - n, "%lu/", (unsigned long)perfBucketLimitsUs[i]);
+  }
+  snprintf(data + n, sizeof(data) - n, "inf;");
+  Serial.println(data);
+  updateBluetoothData(String(data));
+
+  for (size_t i = 0; i < EFFECT_COUNT; i++) {
+    if (compute[i].count) sendPerfLine(effects[i].c_str(), compute[i]);
+  }
+  if (celebration.count) sendPerfLine("Celebration", celebration);
+  sendPerfLine("show", show);
+  sendPerfLine("idle", idle);
+  sendPerfLine("cmd", command);
+  sendPerfLine("cmd_celeb", commandCeleb);
+  sendPerfLine("loop", loopTime);
+
+  snprintf(data, sizeof(data), "STALL:loop_max_us=%lu,over_%dus=%lu,handler_max_us=%lu,handler=%s;",
+           (unsigned long)loopMaxUs, LOOP_STALL_LIMIT_US, (unsigned long)loopStalls,
+           (unsigned long)handlerMaxUs, handlerMaxKey);
+  Serial.println(data);
+  updateBluetoothData(String(data));
+}
+
+// Times FastLED.show() for both strips against their wire times. With
+// parallel output the push takes about as long as the longest strip; sent
+// one after the other it would take the sum.
+void runLedBenchmark() {
+  const uint32_t ringWireUs = NUM_LEDS_RING * WS2812_US_PER_LED + WS2812_RESET_US;
+  const uint32_t boardWireUs = NUM_LEDS_BOARD * WS2812_US_PER_LED + WS2812_RESET_US;
+  const uint32_t serialUs = ringWireUs + boardWireUs;
+  const uint32_t parallelUs = max(ringWireUs, boardWireUs);
+
+  uint64_t totalUs = 0;
+  uint32_t minUs = UINT32_MAX;
+  uint32_t maxUs = 0;
+
+  lockLeds();
+  for (int i = 0; i < LED_BENCH_RUNS; i++) {
+    uint32_t start = micros();
+    FastLED.show();
+    uint32_t elapsed = micros() - start;
+    totalUs += elapsed;
+    if (elapsed < minUs) minUs = elapsed;
+    if (elapsed > maxUs) maxUs = elapsed;
+  }
+  unlockLeds();
+
+  uint32_t avgUs = totalUs / LED_BENCH_RUNS;
+  char data[200];
+  snprintf(data, sizeof(data),
+           "LEDBENCH:driver=%s,runs=%d,avg_us=%lu,min_us=%lu,max_us=%lu,serial_wire_us=%lu,parallel_wire_us=%lu,mode=%s;",
+           LED_DRIVER_NAME, LED_BENCH_RUNS, (unsigned long)avgUs, (unsigned long)minUs, (unsigned long)maxUs,
+           (unsigned long)serialUs, (unsigned long)parallelUs,
+           avgUs < (serialUs + parallelUs) / 2 ? "parallel" : "serial");
+  Serial.println(data);
+  updateBluetoothData(String(data));
+}
+
 // ------------------- Get Partition Information ----------------
 size_t getOtaPartitionSize() {
   const esp_partition_t *configured = esp_ota_get_boot_partition();
@@ -1536,6 +3645,841 @@ void otaLog(const String &msg) {
   Serial.println(msg);  // keep existing serial behavior
 }
 
+void startOtaWriter() {
+  if (otaWriterTaskHandle != NULL) return;
+  otaFreeQueue = xQueueCreate(OTA_POOL_BUFFERS, sizeof(uint8_t));
+  otaFilledQueue = xQueueCreate(OTA_POOL_BUFFERS + 2, sizeof(uint8_t));  // + RESUME and END marks
+  for (uint8_t i = 0; i < OTA_POOL_BUFFERS; i++) xQueueSend(otaFreeQueue, &i, 0);
+  xTaskCreatePinnedToCore(otaWriterTask, "otaWriter", 4096, NULL, 2, &otaWriterTaskHandle, 0);
+}
+
+void otaWriterTask(void *param) {
+  uint8_t idx;
+  for (;;) {
+    if (xQueueReceive(otaFilledQueue, &idx, portMAX_DELAY) != pdTRUE) continue;
+
+    if (idx == OTA_END_MARK) {
+      finishOta();
+      continue;
+    }
+    if (idx == OTA_RESUME_MARK) {
+      if (otaInProgress) otaRestartCredits();
+      continue;
+    }
+
+    if (otaInProgress) {
+      const ota_chunk &chunk = otaPool[idx];
+      bool ok = otaEncoding == OTA_DEFLATE ? otaInflate(chunk.data, chunk.len) : otaEmit(chunk.data, chunk.len);
+      if (!ok) failOtaSession();
+    }
+    xQueueSend(otaFreeQueue, &idx, 0);
+
+    if (otaInProgress) {
+      uint32_t total = 0;
+      portENTER_CRITICAL(&otaCreditMux);
+      if (++otaCreditsPending >= OTA_CREDIT_BATCH) {
+        otaCreditsGranted += otaCreditsPending;
+        otaCreditsPending = 0;
+        total = otaCreditsGranted;
+      }
+      portEXIT_CRITICAL(&otaCreditMux);
+      if (total) otaSendCredits();
+    }
+  }
+}
+
+// Runs on the writer when a chunk fails to decode or write. The app is
+// still sending, so it is told to stop; the END it may never send is not
+// needed to free the inflate window and hash context.
+void failOtaSession() {
+  Update.abort();
+  otaInProgress = false;
+  freeOtaInflator();
+  mbedtls_sha256_free(&otaSha);
+  portENTER_CRITICAL(&otaCreditMux);
+  otaErrorStream = otaStream;
+  portEXIT_CRITICAL(&otaCreditMux);
+  otaSendCredits();
+}
+
+// Runs on the writer when it reaches a RESUME mark: every chunk sent before
+// the disconnect is in flash and the whole pool is idle, so the new stream
+// starts with one credit per buffer.
+void otaRestartCredits() {
+  uint32_t credits = uxQueueMessagesWaiting(otaFreeQueue);
+  otaOpenCreditStream(credits);
+  otaLog("🔁 OTA resumed at " + String(otaBytesQueued) + " / " + String(firmwareSize) + " bytes");
+}
+
+// Image bytes, in order, after any decoding: flash, hash and progress.
+bool otaWriteImage(const uint8_t *data, size_t len) {
+  uint32_t start = micros();
+  size_t written = Update.write((uint8_t *)data, len);
+  otaFlashUs += micros() - start;
+  if (written != len) {
+    otaLog("❌ Chunk write failed at " + String(totalBytesReceived));
+    return false;
+  }
+  mbedtls_sha256_update(&otaSha, data, len);
+  totalBytesReceived += written;
+  if (totalBytesReceived % 10240 < len) {  // every ~10KB
+    int percent = ((int64_t)totalBytesReceived * 100) / firmwareSize;
+    otaLog("📶 OTA progress: " + String(percent) + "%");
+  }
+  return true;
+}
+
+// Feeds one chunk of the deflate stream through the window. tinfl keeps its
+// own state between calls, so chunk boundaries can fall anywhere.
+bool otaInflate(const uint8_t *data, size_t len) {
+  for (;;) {
+    if (otaInflateStatus == TINFL_STATUS_DONE) {
+      if (len > 0) otaLog("❌ Data after end of deflate stream");
+      return len == 0;
+    }
+    size_t inBytes = len;
+    size_t outBytes = TINFL_LZ_DICT_SIZE - otaWindowOfs;
+    otaInflateStatus = tinfl_decompress(otaInflator, data, &inBytes, otaWindow, otaWindow + otaWindowOfs, &outBytes, TINFL_FLAG_HAS_MORE_INPUT);
+    data += inBytes;
+    len -= inBytes;
+    if (outBytes > 0) {
+      if (!otaEmit(otaWindow + otaWindowOfs, outBytes)) return false;
+      otaWindowOfs = (otaWindowOfs + outBytes) & (TINFL_LZ_DICT_SIZE - 1);
+    }
+    if (otaInflateStatus < 0) {
+      otaLog("❌ Corrupt deflate stream (" + String((int)otaInflateStatus) + ")");
+      return false;
+    }
+    if (otaInflateStatus == TINFL_STATUS_NEEDS_MORE_INPUT && len == 0) return true;
+  }
+}
+
+// Decoded stream bytes: through the patch applier for a delta, else
+// straight to flash.
+bool otaEmit(const uint8_t *data, size_t len) {
+  return otaDelta ? otaApplyPatch(data, len) : otaWriteImage(data, len);
+}
+
+uint32_t readLe32(const uint8_t *p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Patch bytes may be split anywhere, so op headers are collected across
+// calls and op bodies are consumed as they arrive.
+bool otaApplyPatch(const uint8_t *data, size_t len) {
+  while (len > 0) {
+    switch (otaPatchState) {
+      case PATCH_MAGIC:
+      case PATCH_ARGS: {
+        size_t need = otaPatchState == PATCH_MAGIC ? 4 : otaPatchHeader[0] == 'A' ? 9 : 5;
+        size_t n = min(len, need - otaPatchHeaderLen);
+        memcpy(otaPatchHeader + otaPatchHeaderLen, data, n);
+        otaPatchHeaderLen += n;
+        data += n;
+        len -= n;
+        if (otaPatchHeaderLen < need) break;
+
+        otaPatchHeaderLen = 0;
+        if (otaPatchState == PATCH_MAGIC) {
+          if (memcmp(otaPatchHeader, "CDP1", 4) != 0) {
+            otaLog("❌ Not a CDP1 patch");
+            return false;
+          }
+          otaPatchState = PATCH_OP;
+        } else if (otaPatchHeader[0] == 'A') {
+          otaPatchSrc = readLe32(otaPatchHeader + 1);
+          otaPatchRemaining = readLe32(otaPatchHeader + 5);
+          if (otaPatchSrc > otaPatchBase->size || otaPatchRemaining > otaPatchBase->size - otaPatchSrc) {
+            otaLog("❌ Patch copy outside the running partition");
+            return false;
+          }
+          otaPatchState = otaPatchRemaining ? PATCH_ADD : PATCH_OP;
+        } else {
+          otaPatchRemaining = readLe32(otaPatchHeader + 1);
+          otaPatchState = otaPatchRemaining ? PATCH_INSERT : PATCH_OP;
+        }
+        break;
+      }
+
+      case PATCH_OP:
+        if (*data != 'A' && *data != 'I') {
+          otaLog("❌ Bad patch op 0x" + String(*data, HEX));
+          return false;
+        }
+        otaPatchHeader[0] = *data;
+        otaPatchHeaderLen = 1;
+        otaPatchState = PATCH_ARGS;
+        data++;
+        len--;
+        break;
+
+      case PATCH_ADD: {
+        size_t n = min(min(len, (size_t)otaPatchRemaining), sizeof(otaPatchSrcBuf));
+        if (esp_partition_read(otaPatchBase, otaPatchSrc, otaPatchSrcBuf, n) != ESP_OK) {
+          otaLog("❌ Reading the running partition failed");
+          return false;
+        }
+        for (size_t i = 0; i < n; i++) otaPatchSrcBuf[i] += data[i];
+        if (!otaWriteImage(otaPatchSrcBuf, n)) return false;
+        otaPatchSrc += n;
+        otaPatchRemaining -= n;
+        data += n;
+        len -= n;
+        if (otaPatchRemaining == 0) otaPatchState = PATCH_OP;
+        break;
+      }
+
+      case PATCH_INSERT: {
+        size_t n = min(len, (size_t)otaPatchRemaining);
+        if (!otaWriteImage(data, n)) return false;
+        otaPatchRemaining -= n;
+        data += n;
+        len -= n;
+        if (otaPatchRemaining == 0) otaPatchState = PATCH_OP;
+        break;
+      }
+    }
+  }
+  return true;
+}
+
+void freeOtaInflator() {
+  free(otaInflator);
+  free(otaWindow);
+  otaInflator = NULL;
+  otaWindow = NULL;
+}
+
+// Starts a new credit stream with `credits` granted. Grants the app still
+// gets for the old stream carry its number, so it drops them.
+void otaOpenCreditStream(uint32_t credits) {
+  portENTER_CRITICAL(&otaCreditMux);
+  otaStream++;
+  otaCreditsPending = 0;
+  otaCreditsGranted = credits;
+  otaErrorStream = 0;
+  portEXIT_CRITICAL(&otaCreditMux);
+  if (credits) otaSendCredits();
+}
+
+// Credits are cumulative, so nothing is queued for them: this only wakes
+// bleTx, which sends the newest total from otaCreditsGranted. A full queue
+// means bleTx is busy and checks before its next message anyway.
+void otaSendCredits() {
+  if (bleNotifyQueue == NULL) return;
+  ble_notify_msg wake;
+  wake.len = 0;
+  xQueueSend(bleNotifyQueue, &wake, 0);
+}
+
+// Runs on bleTx while connected: OTA_CREDIT:<stream>,<total>; when the
+// total moved since the last one sent, and OTA_ERROR:<stream>; once after
+// a writer failure so the app stops instead of timing out.
+void flushOtaCredits() {
+  static uint32_t sentStream = 0, sentTotal = 0;
+  portENTER_CRITICAL(&otaCreditMux);
+  uint32_t stream = otaStream, total = otaCreditsGranted, error = otaErrorStream;
+  otaErrorStream = 0;
+  portEXIT_CRITICAL(&otaCreditMux);
+
+  char data[48];
+  if (total && (stream != sentStream || total != sentTotal)) {
+    bleNotify(data, snprintf(data, sizeof(data), "OTA_CREDIT:%lu,%lu;", (unsigned long)stream, (unsigned long)total));
+    sentStream = stream;
+    sentTotal = total;
+  }
+  if (error) bleNotify(data, snprintf(data, sizeof(data), "OTA_ERROR:%lu;", (unsigned long)error));
+}
+
+// The writer may be inside Update.write(), so it does the abort: chunks
+// still queued are dropped and the END mark reaches finishOta().
+void abortOtaSession() {
+  otaInProgress = false;
+  uint8_t mark = OTA_END_MARK;
+  if (otaFilledQueue) xQueueSend(otaFilledQueue, &mark, 0);
+}
+
+// Opens a session for firmwareSize bytes once the caller has set the
+// digest, encoding and delta fields. Shared by BLE BEGIN and the relay.
+bool beginOtaSession() {
+  startOtaWriter();
+  if (uxQueueMessagesWaiting(otaFilledQueue) > 0) {
+    otaLog("❌ Previous OTA still draining, try again");
+    return false;
+  }
+
+  freeOtaInflator();  // In case a failed session left them behind
+  otaInProgress = true;  // Render task stops drawing from here on
+  totalBytesReceived = 0;
+  lockLeds();
+  FastLED.clear();
+  fill_solid(boardLeds, NUM_LEDS_BOARD, CRGB::Yellow);
+  FastLED.show();
+  unlockLeds();
+
+  if (!Update.begin(firmwareSize)) {
+    otaLog("❌ Update.begin() failed");
+    otaInProgress = false;
+    return false;
+  }
+
+  if (otaEncoding == OTA_DEFLATE) {
+    otaInflator = (tinfl_decompressor *)malloc(sizeof(tinfl_decompressor));
+    otaWindow = (uint8_t *)malloc(TINFL_LZ_DICT_SIZE);
+    if (otaInflator == NULL || otaWindow == NULL) {
+      otaLog("❌ No RAM for the inflate window");
+      freeOtaInflator();
+      Update.abort();
+      otaInProgress = false;
+      return false;
+    }
+    tinfl_init(otaInflator);
+    otaWindowOfs = 0;
+    otaInflateStatus = TINFL_STATUS_NEEDS_MORE_INPUT;
+  }
+
+  mbedtls_sha256_init(&otaSha);
+  mbedtls_sha256_starts(&otaSha, 0);
+  otaBytesQueued = 0;
+  otaOpenCreditStream(0);  // The caller grants once it is ready for chunks
+  otaStartMs = millis();
+  otaLastActivityMs = otaStartMs;
+  otaFlashUs = 0;
+  otaPoolLowWater = OTA_POOL_BUFFERS;
+  otaLog(String("✅ Update.begin() successful") + (otaEncoding == OTA_DEFLATE ? " (deflate stream)" : "") + (otaDelta ? " (delta patch)" : ""));
+  return true;
+}
+
+// Called from the OTA callback with "<offset>:<sha256 hex>". The BLE task
+// must not wait for the pool to drain, so a RESUME mark goes through the
+// writer queue behind the chunks still in flight; otaRestartCredits() then
+// answers with the new stream's credits.
+bool resumeOtaSession(const char *args) {
+  uint32_t offset = strtoul(args, NULL, 10);
+  const char *digest = strchr(args, ':');
+  uint8_t sha[OTA_SHA256_LEN];
+
+  if (!otaInProgress || digest == NULL || !parseSha256Hex(digest + 1, sha) || memcmp(sha, otaExpectedSha, OTA_SHA256_LEN) != 0) {
+    otaLog("❌ No matching OTA session to resume");
+    return false;
+  }
+  if (offset != otaBytesQueued) {
+    otaLog("❌ Resume offset " + String(offset) + " != board offset " + String(otaBytesQueued));
+    return false;
+  }
+
+  uint8_t mark = OTA_RESUME_MARK;
+  if (xQueueSend(otaFilledQueue, &mark, 0) != pdTRUE) {
+    otaLog("❌ RESUME already pending");
+    return false;
+  }
+  otaLastActivityMs = millis();
+  return true;
+}
+
+void formatOtaStatus(char *data, size_t size) {
+  if (!otaInProgress) {
+    snprintf(data, size, "OTA:active=0,stream=%lu;", (unsigned long)otaStream);
+    return;
+  }
+  char hex[OTA_SHA256_LEN * 2 + 1];
+  for (int i = 0; i < OTA_SHA256_LEN; i++) sprintf(hex + i * 2, "%02x", otaExpectedSha[i]);
+  snprintf(data, size, "OTA:active=1,stream=%lu,offset=%lu,size=%d,enc=%s,delta=%d,sha=%s;",
+           (unsigned long)otaStream, (unsigned long)otaBytesQueued, firmwareSize,
+           otaEncoding == OTA_DEFLATE ? "deflate" : "raw", otaDelta, hex);
+}
+
+// Runs from loop(): expires a session the app walked away from.
+void serviceOtaSession() {
+  if (otaInProgress && millis() - otaLastActivityMs > OTA_SESSION_TIMEOUT_MS) {
+    otaLog("⌛ OTA session expired at " + String(otaBytesQueued) + " bytes");
+    abortOtaSession();
+  }
+}
+
+// Runs on the otaWriter task once END has drained through the pool.
+void finishOta() {
+  if (!otaInProgress) {
+    mbedtls_sha256_free(&otaSha);
+    freeOtaInflator();
+    Update.abort();  // No-op if the writer already aborted
+    Serial.println("OTA END after abort, nothing to finalize");
+    relayReportResult(false);
+    return;
+  }
+  otaInProgress = false;
+  bool streamComplete = (otaEncoding != OTA_DEFLATE || otaInflateStatus == TINFL_STATUS_DONE) && (!otaDelta || otaPatchState == PATCH_OP);
+  freeOtaInflator();
+
+  // Link time scales with stream bytes, so a raw send of the same image
+  // would have taken about elapsed * image / stream
+  unsigned long elapsedMs = max(1UL, millis() - otaStartMs);
+  uint32_t streamBytes = max(1UL, (unsigned long)otaBytesQueued);
+  char data[200];
+  snprintf(data, sizeof(data), "📊 OTA: %d bytes in %lu ms, %.1f KB/s (flash busy %lu%%, min idle buffers %lu/%d)",
+           totalBytesReceived, elapsedMs, totalBytesReceived / 1.024f / elapsedMs,
+           (unsigned long)(otaFlashUs / 10 / elapsedMs), (unsigned long)otaPoolLowWater, OTA_POOL_BUFFERS);
+  otaLog(data);
+  if (otaEncoding == OTA_DEFLATE || otaDelta) {
+    snprintf(data, sizeof(data), "📊 %s: sent %lu of %d bytes (%lu%%), %lu ms vs ~%lu ms raw",
+             otaDelta ? "Delta" : "Deflate", (unsigned long)streamBytes, totalBytesReceived, (unsigned long)((uint64_t)streamBytes * 100 / max(1, totalBytesReceived)),
+             elapsedMs, (unsigned long)((uint64_t)elapsedMs * totalBytesReceived / streamBytes));
+    otaLog(data);
+  }
+  if (!streamComplete) {
+    Update.abort();
+    mbedtls_sha256_free(&otaSha);
+    otaLog("❌ OTA stream ended early");
+    relayReportResult(false);
+    return;
+  }
+
+  lockLeds();
+  fill_solid(boardLeds, NUM_LEDS_BOARD, CRGB::Green);
+  FastLED.show();
+  delay(500);
+  FastLED.clear(true);
+  unlockLeds();
+  otaLog("📦 Firmware write complete (" + String(totalBytesReceived) + " bytes)");
+  otaLog("🔍 Validating firmware...");
+
+  uint8_t digest[OTA_SHA256_LEN];
+  mbedtls_sha256_finish(&otaSha, digest);
+  mbedtls_sha256_free(&otaSha);
+  if (memcmp(digest, otaExpectedSha, OTA_SHA256_LEN) != 0) {
+    Update.abort();
+    otaLog("❌ OTA SHA-256 mismatch, image discarded");
+    relayReportResult(false);
+    return;
+  }
+  otaLog("✅ SHA-256 verified");
+
+  if (Update.end(true)) {
+    otaLog("✅ OTA Success — restarting...");
+    // loop() restarts, so the settings flush is not racing it from this task
+    bool relayed = relayRx.active;
+    relayReportResult(true);
+    scheduleRestart(relayed ? RELAY_RESTART_DELAY_MS : 0);
+  } else {
+    otaLog("❌ OTA Write failed (validation)");
+    relayReportResult(false);
+  }
+}
+
+// ---------------------- OTA Relay over ESP-NOW ----------------------
+void cmdRelay(const char *args) {
+  if (deviceRole != PRIMARY || relayRunning || otaInProgress) {
+    otaLog("❌ Relay needs an idle PRIMARY");
+    return;
+  }
+  relayRunning = true;
+  xTaskCreatePinnedToCore(relayTask, "otaRelay", 6144, NULL, 1, &relayTaskHandle, 0);
+}
+
+void relayTask(void *param) {
+  const esp_partition_t *part = esp_ota_get_running_partition();
+  esp_partition_pos_t pos = { part->address, part->size };
+  esp_image_metadata_t meta;
+  if (esp_image_verify(ESP_IMAGE_VERIFY_SILENT, &pos, &meta) != ESP_OK) {
+    otaLog("❌ Relay: running image does not verify");
+    relayRunning = false;
+    vTaskDelete(NULL);
+  }
+
+  uint32_t size = meta.image_len;
+  uint16_t chunks = (size + RELAY_CHUNK_LEN - 1) / RELAY_CHUNK_LEN;
+  relaySession = esp_random() | 1;
+
+  relay_begin begin = {};
+  begin.magic = RELAY_MAGIC;
+  begin.type = RELAY_BEGIN;
+  begin.session = relaySession;
+  begin.size = size;
+  begin.chunks = chunks;
+  strncpy(begin.version, getFirmwareVersion(), sizeof(begin.version) - 1);
+
+  mbedtls_sha256_context sha;
+  uint8_t buf[RELAY_CHUNK_LEN];
+  mbedtls_sha256_init(&sha);
+  mbedtls_sha256_starts(&sha, 0);
+  for (uint32_t ofs = 0; ofs < size; ofs += sizeof(buf)) {
+    size_t n = min((uint32_t)sizeof(buf), size - ofs);
+    esp_partition_read(part, ofs, buf, n);
+    mbedtls_sha256_update(&sha, buf, n);
+  }
+  mbedtls_sha256_finish(&sha, begin.sha);
+  mbedtls_sha256_free(&sha);
+
+  portENTER_CRITICAL(&relayMux);
+  relayPeerCount = 0;
+  portEXIT_CRITICAL(&relayMux);
+  relayJoinOpen = true;
+  otaLog("📡 Relay: offering " + String(begin.version) + " (" + String(size) + " bytes) over ESP-NOW");
+  unsigned long joinStart = millis();
+  while (millis() - joinStart < RELAY_JOIN_MS) {
+    relaySend(broadcastMAC, &begin, sizeof(begin));
+    vTaskDelay(pdMS_TO_TICKS(200));
+  }
+  relayJoinOpen = false;
+
+  int joined = relayCount(false);
+  if (joined == 0) {
+    otaLog("🟢 Relay: no board needs " + String(begin.version));
+    relayRunning = false;
+    vTaskDelete(NULL);
+  }
+  otaLog("📡 Relay: " + String(joined) + " board(s) joined");
+
+  unsigned long start = millis();
+  uint32_t dataFrames = 0;
+  uint32_t repairFrames = 0;
+  uint32_t unicastRepairs = 0;
+  uint32_t missing;
+  int8_t lacking[RELAY_WINDOW];
+  int lastPercent = 0;
+  for (uint16_t windowStart = 0; windowStart < chunks && relayCount(false) > 0;) {
+    uint16_t windowEnd = min(windowStart + RELAY_WINDOW, (int)chunks);
+    for (uint16_t c = windowStart; c < windowEnd; c++) relaySendChunk(part, size, c, broadcastMAC);
+    dataFrames += windowEnd - windowStart;
+
+    // relayPeers only grows while the join is open, so the MACs are stable here
+    while (!relayPoll(RELAY_POLL, windowStart, windowEnd, &missing, lacking) && relayCount(false) > 0) {
+      for (int i = 0; i < RELAY_WINDOW; i++) {
+        if (!(missing & (1UL << i))) continue;
+        bool unicast = lacking[i] >= 0;
+        relaySendChunk(part, size, windowStart + i, unicast ? relayPeers[lacking[i]].mac : broadcastMAC);
+        repairFrames++;
+        if (unicast) unicastRepairs++;
+      }
+    }
+    windowStart = windowEnd;
+
+    // RELAY:<percent>,<boards>; drives the app's progress bar, the log
+    // gets a line every 10%
+    int percent = (uint32_t)windowEnd * 100 / chunks;
+    if (percent == lastPercent) continue;
+    int boards = relayCount(false);
+    updateBluetoothData("RELAY:" + String(percent) + "," + String(boards) + ";");
+    if (percent / 10 > lastPercent / 10) {
+      unsigned long elapsedMs = max(1UL, millis() - start);
+      float kbPerSec = min((uint32_t)windowEnd * RELAY_CHUNK_LEN, size) / 1.024f / elapsedMs;
+      otaLog("📡 Relay: " + String(percent) + "% to " + String(boards) + " board(s), " + String(kbPerSec, 1) + " KB/s");
+    }
+    lastPercent = percent;
+  }
+
+  // Boards verify and answer with a RESULT, then restart
+  unsigned long endStart = millis();
+  while (relayCount(true) > 0 && millis() - endStart < RELAY_RESULT_TIMEOUT_MS) {
+    relayPoll(RELAY_END, chunks, chunks, &missing, lacking);
+    vTaskDelay(pdMS_TO_TICKS(200));
+  }
+
+  int updated = 0;
+  portENTER_CRITICAL(&relayMux);
+  for (int i = 0; i < relayPeerCount; i++) {
+    if (relayPeers[i].result == 1) updated++;
+  }
+  portEXIT_CRITICAL(&relayMux);
+
+  unsigned long elapsedMs = max(1UL, millis() - start);
+  char data[200];
+  snprintf(data, sizeof(data), "📊 Relay: %lu bytes in %lu ms, %.1f KB/s, %lu repair frames (%lu%%, %lu unicast), %d of %d board(s) updated",
+           (unsigned long)size, elapsedMs, size / 1.024f / elapsedMs, (unsigned long)repairFrames,
+           (unsigned long)(repairFrames * 100 / max(1UL, (unsigned long)dataFrames)), (unsigned long)unicastRepairs,
+           updated, joined);
+  otaLog(data);
+  relayRunning = false;
+  vTaskDelete(NULL);
+}
+
+// esp_now_send() refuses when its buffers are full; that is the pacing.
+esp_err_t relaySend(const uint8_t *mac, const void *frame, size_t len) {
+  esp_err_t err = ESP_OK;
+  for (int tries = 0; tries < 50; tries++) {
+    err = esp_now_send(mac, (const uint8_t *)frame, len);
+    if (err != ESP_ERR_ESPNOW_NO_MEM) break;
+    vTaskDelay(1);
+  }
+  return err;
+}
+
+size_t relayChunkLen(uint32_t size, uint16_t chunk) {
+  return min((uint32_t)RELAY_CHUNK_LEN, size - (uint32_t)chunk * RELAY_CHUNK_LEN);
+}
+
+// mac is broadcastMAC for the first pass and shared repairs. A unicast
+// repair falls back to broadcast if the send is refused.
+void relaySendChunk(const esp_partition_t *part, uint32_t size, uint16_t chunk, const uint8_t *mac) {
+  relay_data frame;
+  frame.magic = RELAY_MAGIC;
+  frame.type = RELAY_DATA;
+  frame.session = relaySession;
+  frame.chunk = chunk;
+  size_t len = relayChunkLen(size, chunk);
+  esp_partition_read(part, (uint32_t)chunk * RELAY_CHUNK_LEN, frame.data, len);
+  frame.crc = esp_crc32_le(0, frame.data, len);
+  if (mac != broadcastMAC) {
+    if (!esp_now_is_peer_exist(mac)) addKnownPeer(mac);
+    if (relaySend(mac, &frame, offsetof(relay_data, data) + len) == ESP_OK) return;
+  }
+  relaySend(broadcastMAC, &frame, offsetof(relay_data, data) + len);
+}
+
+// Polls the live boards and waits for their statuses. Returns true once
+// every live board has all of [windowStart, windowEnd); otherwise sets a
+// bit in *missing for each chunk of the window some board still lacks, and
+// lacking[i] to the relayPeers index of the only board missing chunk i, or
+// -1 when more than one is.
+bool relayPoll(uint8_t type, uint16_t windowStart, uint16_t windowEnd, uint32_t *missing, int8_t *lacking) {
+  relay_poll poll = { RELAY_MAGIC, type, relaySession, windowEnd };
+  unsigned long sentAt = millis();
+  relaySend(broadcastMAC, &poll, sizeof(poll));
+  vTaskDelay(pdMS_TO_TICKS(RELAY_POLL_MS));
+
+  bool allDone = true;
+  int dropped = 0;
+  *missing = 0;
+  portENTER_CRITICAL(&relayMux);
+  for (int i = 0; i < relayPeerCount; i++) {
+    RelayPeer &p = relayPeers[i];
+    if (!p.live) continue;
+    if ((long)(p.statusAt - sentAt) < 0) {
+      if (++p.silentPolls > RELAY_MAX_SILENT_POLLS && p.result < 0) {
+        p.live = false;
+        dropped++;
+      } else {
+        allDone = false;
+      }
+      continue;
+    }
+    p.silentPolls = 0;
+    if (p.base >= windowEnd) continue;
+    allDone = false;
+    for (uint16_t c = max(p.base, windowStart); c < windowEnd; c++) {
+      if ((p.held >> (c - p.base)) & 1) continue;
+      uint32_t bit = 1UL << (c - windowStart);
+      lacking[c - windowStart] = (*missing & bit) ? -1 : i;
+      *missing |= bit;
+    }
+  }
+  portEXIT_CRITICAL(&relayMux);
+
+  if (dropped) otaLog("⚠️ Relay: " + String(dropped) + " board(s) stopped answering");
+  return allDone;
+}
+
+// Boards still in the relay; pendingOnly leaves out those that reported.
+int relayCount(bool pendingOnly) {
+  int n = 0;
+  portENTER_CRITICAL(&relayMux);
+  for (int i = 0; i < relayPeerCount; i++) {
+    if (relayPeers[i].live && (!pendingOnly || relayPeers[i].result < 0)) n++;
+  }
+  portEXIT_CRITICAL(&relayMux);
+  return n;
+}
+
+// Runs on the comms task.
+void handleRelayFrame(const uint8_t *mac, const uint8_t *data, int len) {
+  uint8_t type = data[1];
+  if (type == RELAY_STATUS || type == RELAY_RESULT) {
+    relayNoteReply(mac, data, len);
+    return;
+  }
+  if (deviceRole == PRIMARY) return;
+
+  if (type == RELAY_BEGIN && len == sizeof(relay_begin)) {
+    relayRxBegin(mac, (const relay_begin *)data);
+  } else if (type == RELAY_DATA && len > (int)offsetof(relay_data, data)) {
+    relayRxData((const relay_data *)data, len);
+  } else if ((type == RELAY_POLL || type == RELAY_END) && len == sizeof(relay_poll)) {
+    relayRxPoll((const relay_poll *)data);
+  }
+}
+
+void relayNoteReply(const uint8_t *mac, const uint8_t *data, int len) {
+  if (!relayRunning || data[2] != relaySession) return;
+  bool status = data[1] == RELAY_STATUS && len == sizeof(relay_status);
+  bool result = data[1] == RELAY_RESULT && len == sizeof(relay_result);
+  if (!status && !result) return;
+
+  portENTER_CRITICAL(&relayMux);
+  RelayPeer *p = nullptr;
+  for (int i = 0; i < relayPeerCount; i++) {
+    if (memcmp(relayPeers[i].mac, mac, 6) == 0) p = &relayPeers[i];
+  }
+  if (!p && status && relayJoinOpen && relayPeerCount < MAX_PEERS) {
+    p = &relayPeers[relayPeerCount++];
+    memcpy(p->mac, mac, 6);
+    p->live = true;
+    p->silentPolls = 0;
+    p->result = -1;
+  }
+  if (p && status) {
+    const relay_status *st = (const relay_status *)data;
+    p->base = st->base;
+    p->held = st->held;
+    p->statusAt = millis();
+  } else if (p && result) {
+    p->result = ((const relay_result *)data)->ok ? 1 : 0;
+    if (p->result == 0) p->live = false;
+  }
+  portEXIT_CRITICAL(&relayMux);
+}
+
+void relayRxBegin(const uint8_t *mac, const relay_begin *begin) {
+  if (relayRx.active) {
+    if (begin->session == relayRx.session) relayRxSendStatus();  // Our first reply was lost
+    return;
+  }
+  if (relayRx.result >= 0 && begin->session == relayRx.session) {
+    relayRxSendResult();  // Finished this one; the PRIMARY missed the RESULT
+    return;
+  }
+  if (otaInProgress) return;
+
+  char version[sizeof(begin->version) + 1];
+  memcpy(version, begin->version, sizeof(begin->version));
+  version[sizeof(begin->version)] = '\0';
+  if (strcmp(version, getFirmwareVersion()) == 0) return;  // Already up to date
+
+  if (relayWindow == NULL) relayWindow = (uint8_t *)malloc(RELAY_WINDOW * RELAY_CHUNK_LEN);
+  if (relayWindow == NULL || begin->size == 0 || begin->size > getOtaPartitionSize()) return;
+
+  firmwareSize = begin->size;
+  memcpy(otaExpectedSha, begin->sha, OTA_SHA256_LEN);
+  otaEncoding = OTA_RAW;
+  otaDelta = false;
+  if (!beginOtaSession()) return;
+
+  relayRx.session = begin->session;
+  memcpy(relayRx.primary, mac, 6);
+  relayRx.chunks = begin->chunks;
+  relayRx.base = 0;
+  relayRx.held = 0;
+  relayRx.endSeen = false;
+  relayRx.endQueued = false;
+  relayRx.crcErrors = 0;
+  relayRx.result = -1;
+  relayRx.active = true;
+  Serial.println("📡 Relay from " + macToString(mac) + ": " + String(version) + ", " + String(begin->size) + " bytes");
+  relayRxSendStatus();
+}
+
+void relayRxData(const relay_data *frame, int len) {
+  if (!relayRx.active || frame->session != relayRx.session) return;
+  uint16_t chunk = frame->chunk;
+  size_t dataLen = len - offsetof(relay_data, data);
+  if (chunk < relayRx.base || chunk >= relayRx.base + RELAY_WINDOW || chunk >= relayRx.chunks) return;  // Repeat or too far ahead
+  if (dataLen != relayChunkLen(firmwareSize, chunk)) return;
+  if (esp_crc32_le(0, frame->data, dataLen) != frame->crc) {
+    relayRx.crcErrors++;  // Left out of the bitmap, so it is resent
+    return;
+  }
+  memcpy(relayWindow + (chunk % RELAY_WINDOW) * RELAY_CHUNK_LEN, frame->data, dataLen);
+  relayRx.held |= 1UL << (chunk - relayRx.base);
+  relayRxFlush();
+}
+
+void relayRxPoll(const relay_poll *poll) {
+  if (poll->session != relayRx.session) return;
+  if (!relayRx.active) {
+    if (relayRx.result >= 0) relayRxSendResult();  // Still polled, so the RESULT was lost
+    return;
+  }
+  if (poll->type == RELAY_END) relayRx.endSeen = true;
+  relayRxFlush();
+  if (relayRx.active) relayRxSendStatus();
+}
+
+// Hands every in-order chunk to the writer while it has free buffers; the
+// rest wait in relayWindow for the next frame or poll.
+void relayRxFlush() {
+  if (!otaInProgress && !relayRx.endQueued) {
+    relayReportResult(false);  // The writer failed or the session expired
+    return;
+  }
+  uint8_t idx;
+  while ((relayRx.held & 1) && xQueueReceive(otaFreeQueue, &idx, 0) == pdTRUE) {
+    size_t n = relayChunkLen(firmwareSize, relayRx.base);
+    memcpy(otaPool[idx].data, relayWindow + (relayRx.base % RELAY_WINDOW) * RELAY_CHUNK_LEN, n);
+    otaPool[idx].len = n;
+    xQueueSend(otaFilledQueue, &idx, portMAX_DELAY);
+    otaBytesQueued += n;
+    otaLastActivityMs = millis();
+    relayRx.held >>= 1;
+    relayRx.base++;
+  }
+  if (relayRx.endSeen && !relayRx.endQueued && relayRx.base == relayRx.chunks) {
+    uint8_t mark = OTA_END_MARK;
+    xQueueSend(otaFilledQueue, &mark, portMAX_DELAY);
+    relayRx.endQueued = true;
+  }
+}
+
+void relayRxSendResult() {
+  relay_result result = { RELAY_MAGIC, RELAY_RESULT, relayRx.session, (uint8_t)relayRx.result };
+  esp_now_send(relayRx.primary, (const uint8_t *)&result, sizeof(result));
+}
+
+void relayRxSendStatus() {
+  relay_status status = { RELAY_MAGIC, RELAY_STATUS, relayRx.session, relayRx.base, relayRx.held };
+  if (!esp_now_is_peer_exist(relayRx.primary)) addKnownPeer(relayRx.primary);
+  esp_now_send(relayRx.primary, (const uint8_t *)&status, sizeof(status));
+}
+
+// SECONDARY: tells the PRIMARY how the relay ended. No-op outside a relay.
+// The PRIMARY keeps polling until it hears a RESULT, and each poll of the
+// finished session gets it again.
+void relayReportResult(bool ok) {
+  if (!relayRx.active) return;
+  relayRx.result = ok;
+  relayRx.active = false;
+  relayRxSendResult();
+  Serial.printf("📡 Relay %s (%lu CRC errors)\n", ok ? "complete" : "failed", (unsigned long)relayRx.crcErrors);
+}
+
+bool parseSha256Hex(const char *hex, uint8_t *out) {
+  for (int i = 0; i < OTA_SHA256_LEN * 2; i++) {
+    if (!isxdigit((unsigned char)hex[i])) return false;
+  }
+  for (int i = 0; i < OTA_SHA256_LEN; i++) {
+    char byteHex[3] = { hex[i * 2], hex[i * 2 + 1], '\0' };
+    out[i] = strtoul(byteHex, NULL, 16);
+  }
+  return true;
+}
+
+// Keeps the Arduino core from marking a freshly flashed image valid before
+// setup() runs; otaSelfTest() makes that call instead.
+extern "C" bool verifyRollbackLater() {
+  return true;
+}
+
+void otaSelfTest() {
+  esp_ota_img_states_t state;
+  const esp_partition_t *running = esp_ota_get_running_partition();
+  if (esp_ota_get_state_partition(running, &state) != ESP_OK || state != ESP_OTA_IMG_PENDING_VERIFY) return;
+
+  render_stats stats;
+  portENTER_CRITICAL(&renderMux);
+  stats = renderStats;
+  portEXIT_CRITICAL(&renderMux);
+
+  bool ledsOk = renderTaskHandle != NULL && stats.framesDrawn + stats.framesElided + stats.framesDark > 0;
+  bool bleOk = deviceRole != PRIMARY || pServer != NULL;
+  Serial.printf("🩺 OTA self-test: leds=%d espnow=%d ble=%d\n", ledsOk, espNowReady, bleOk);
+
+  if (ledsOk && espNowReady && bleOk) {
+    esp_ota_mark_app_valid_cancel_rollback();
+    otaLog("✅ New firmware " + String(getFirmwareVersion()) + " passed self-test");
+  } else {
+    Serial.println("❌ Self-test failed, rolling back");
+    esp_ota_mark_app_invalid_rollback_and_reboot();
+  }
+}
+
 const char *getFirmwareVersion() {
   return ARDUINO_FW_VERSION;
 }
\ No newline at end of file
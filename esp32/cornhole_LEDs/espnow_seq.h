@@ -0,0 +1,71 @@
+// ESP-NOW sequence numbering and per-sender duplicate detection. Plain C++
+// so esp32/tests can build it on the host.
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#define ESPNOW_DEDUP_WINDOW 32
+
+struct PeerSeqWindow {
+  uint8_t mac[6];
+  uint8_t session;
+  uint16_t highest;
+  uint32_t seen;  // bit i set = sequence (highest - i) already received
+  unsigned long lastUsed;
+  bool used;
+};
+
+// Both loop() and the comms task send, so the counter is bumped
+// atomically; two frames sharing a seq would look like a repeat.
+inline uint16_t nextSeq(std::atomic<uint16_t> &counter) {
+  return counter.fetch_add(1, std::memory_order_relaxed) + 1;
+}
+
+// Sliding-window replay check, one window per sender. Returns true if this
+// (session, seq) was already accepted from mac. The least recently used
+// window is recycled for a new sender.
+inline bool isDuplicateSeq(PeerSeqWindow *windows, size_t count, const uint8_t *mac, uint8_t session, uint16_t seq,
+                           unsigned long now) {
+  PeerSeqWindow *w = nullptr;
+  PeerSeqWindow *oldest = &windows[0];
+  for (size_t i = 0; i < count; i++) {
+    if (windows[i].used && memcmp(windows[i].mac, mac, 6) == 0) {
+      w = &windows[i];
+      break;
+    }
+    if (!windows[i].used || (oldest->used && windows[i].lastUsed < oldest->lastUsed)) {
+      oldest = &windows[i];
+    }
+  }
+
+  if (w == nullptr || w->session != session) {
+    if (w == nullptr) {
+      w = oldest;
+      memcpy(w->mac, mac, 6);
+      w->used = true;
+    }
+    w->session = session;
+    w->highest = seq;
+    w->seen = 1;
+    w->lastUsed = now;
+    return false;
+  }
+  w->lastUsed = now;
+
+  int16_t diff = (int16_t)(seq - w->highest);
+  if (diff > 0) {
+    w->seen = (diff >= ESPNOW_DEDUP_WINDOW) ? 1 : ((w->seen << diff) | 1);
+    w->highest = seq;
+    return false;
+  }
+
+  int back = -diff;
+  if (back >= ESPNOW_DEDUP_WINDOW) return true;  // too old to tell, treat as a stale retransmit
+  uint32_t bit = 1UL << back;
+  if (w->seen & bit) return true;
+  w->seen |= bit;
+  return false;
+}
@@ -0,0 +1,52 @@
+// CMD:INFO reply slots. Plain C++ so esp32/tests can simulate a refresh of
+// the board list on the host.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+
+#define INFO_SLOT_MS 15
+#define INFO_UNLISTED_SLOTS 4  // Shared by boards the PRIMARY does not know yet
+
+// The PRIMARY forwards CMD:INFO with its peer table as the argument,
+// "aabbccddeeff,112233445566,...". The board at index i answers in slot
+// i + 1 and the PRIMARY itself in slot 0, so no two known boards share a
+// slot. Writes the list to out and returns its length.
+inline size_t formatInfoSlots(char *out, size_t size, const uint8_t (*peers)[6], int count) {
+  size_t len = 0;
+  if (size == 0) return 0;
+  out[0] = '\0';
+  for (int i = 0; i < count && len + 14 <= size; i++) {
+    len += snprintf(out + len, size - len, "%s%02x%02x%02x%02x%02x%02x", i ? "," : "", peers[i][0], peers[i][1],
+                    peers[i][2], peers[i][3], peers[i][4], peers[i][5]);
+  }
+  return len;
+}
+
+inline int infoHexValue(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+// Slot for a board with MAC self, given the list from the request. A board
+// missing from it (or a request from older firmware, with no list) answers
+// after the listed slots, spread by MAC.
+inline int infoSlotFor(const char *list, const uint8_t *self) {
+  int index = 0;
+  const char *p = list;
+  while (*p) {
+    bool match = true;
+    int digits = 0;
+    for (; *p && *p != ','; p++, digits++) {
+      int v = infoHexValue(*p);
+      if (digits >= 12 || v < 0 || v != ((self[digits / 2] >> (digits % 2 ? 0 : 4)) & 0x0F)) match = false;
+    }
+    if (match && digits == 12) return index + 1;
+    index++;
+    if (*p == ',') p++;
+  }
+  return index + 1 + self[5] % INFO_UNLISTED_SLOTS;
+}
@@ -0,0 +1,78 @@
+// Role election rules. Plain C++ so esp32/tests can simulate a group of
+// boards on the host; the sketch wraps these with roleMux and the radio.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#define ROLE_ELECTION_WINDOW_MS 500
+#define ROLE_REANNOUNCE_MS 5000
+#define ROLE_CLAIM_TTL_MS (3 * ROLE_REANNOUNCE_MS)  // A board silent this long is gone
+
+struct RoleClaim {
+  bool used;
+  uint8_t mac[6];
+  bool primary;
+  uint8_t session;  // ESP-NOW session of the claim; changes when the board reboots
+  unsigned long seenAt;
+};
+
+enum RoleDecision {
+  ROLE_KEEP,
+  ROLE_STEP_DOWN,
+  ROLE_PROMOTE,
+};
+
+inline bool roleClaimLive(const RoleClaim &claim, unsigned long now) {
+  return claim.used && now - claim.seenAt < ROLE_CLAIM_TTL_MS;
+}
+
+// Records a claim. Returns true when the sender should hear our role back:
+// it is new to us (never heard, expired, or rebooted since its last claim)
+// or it just changed role, so a second PRIMARY learns of the first at once.
+inline bool recordRoleClaim(RoleClaim *claims, size_t count, const uint8_t *mac, bool primary, uint8_t session,
+                            unsigned long now) {
+  bool answer = true;
+  RoleClaim *slot = nullptr;
+  for (size_t i = 0; i < count; i++) {
+    if (claims[i].used && memcmp(claims[i].mac, mac, 6) == 0) {
+      slot = &claims[i];
+      answer = !roleClaimLive(*slot, now) || slot->session != session || slot->primary != primary;
+      break;
+    }
+    if (!slot && !roleClaimLive(claims[i], now)) slot = &claims[i];
+  }
+  if (slot) {
+    slot->used = true;
+    memcpy(slot->mac, mac, 6);
+    slot->primary = primary;
+    slot->session = session;
+    slot->seenAt = now;
+  }
+  return answer;
+}
+
+// Of two PRIMARYs the lower MAC keeps the role. With no live PRIMARY claim,
+// the lowest MAC still heard promotes itself once the election window since
+// boot has passed.
+inline RoleDecision decideRole(const RoleClaim *claims, size_t count, const uint8_t *self, bool isPrimary,
+                               unsigned long electionStart, unsigned long now) {
+  bool primaryHeard = false;
+  bool lowerPrimary = false;
+  bool lowestMac = true;
+
+  for (size_t i = 0; i < count; i++) {
+    if (!roleClaimLive(claims[i], now)) continue;
+    bool lower = memcmp(claims[i].mac, self, 6) < 0;
+    if (lower) lowestMac = false;
+    if (claims[i].primary) {
+      primaryHeard = true;
+      if (lower) lowerPrimary = true;
+    }
+  }
+
+  if (isPrimary && lowerPrimary) return ROLE_STEP_DOWN;
+  if (!isPrimary && !primaryHeard && lowestMac && now - electionStart >= ROLE_ELECTION_WINDOW_MS) return ROLE_PROMOTE;
+  return ROLE_KEEP;
+}
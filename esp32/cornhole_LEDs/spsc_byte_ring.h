@@ -0,0 +1,65 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// Single-producer/single-consumer byte ring. The BLE task pushes whole writes,
+// loop() pops. Indices are free-running; the producer publishes head with
+// release and the consumer publishes tail with release, each side reading the
+// other's index with acquire.
+template <size_t N>
+class SpscByteRing {
+  static_assert((N & (N - 1)) == 0, "SpscByteRing capacity must be a power of two");
+
+public:
+  // Producer side. Writes are all-or-nothing so a command is never split by an overflow.
+  bool push(const uint8_t *data, size_t len) {
+    size_t head = headIdx.load(std::memory_order_relaxed);
+    size_t tail = tailIdx.load(std::memory_order_acquire);
+    if (len > N - (head - tail)) {
+      droppedWrites.fetch_add(1, std::memory_order_relaxed);
+      droppedBytes.fetch_add(len, std::memory_order_relaxed);
+      return false;
+    }
+    size_t pos = head & (N - 1);
+    size_t first = std::min(len, N - pos);
+    memcpy(buf + pos, data, first);
+    memcpy(buf, data + first, len - first);
+    headIdx.store(head + len, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer side.
+  size_t pop(uint8_t *out, size_t maxLen) {
+    size_t tail = tailIdx.load(std::memory_order_relaxed);
+    size_t head = headIdx.load(std::memory_order_acquire);
+    size_t len = std::min(maxLen, head - tail);
+    size_t pos = tail & (N - 1);
+    size_t first = std::min(len, N - pos);
+    memcpy(out, buf + pos, first);
+    memcpy(out + first, buf, len - first);
+    tailIdx.store(tail + len, std::memory_order_release);
+    return len;
+  }
+
+  bool empty() const {
+    return headIdx.load(std::memory_order_acquire) == tailIdx.load(std::memory_order_relaxed);
+  }
+
+  uint32_t getDroppedWrites() const {
+    return droppedWrites.load(std::memory_order_relaxed);
+  }
+  uint32_t getDroppedBytes() const {
+    return droppedBytes.load(std::memory_order_relaxed);
+  }
+
+private:
+  uint8_t buf[N];
+  std::atomic<size_t> headIdx{ 0 };
+  std::atomic<size_t> tailIdx{ 0 };
+  std::atomic<uint32_t> droppedWrites{ 0 };
+  std::atomic<uint32_t> droppedBytes{ 0 };
+};
@@ -0,0 +1,119 @@
+// Host benchmark: table dispatch in processCommand() against the
+// startsWith() chain it replaced. Build and run with `make bench`.
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "command_table.h"
+
+static volatile unsigned handled;
+static void stub(const char *args) {
+  handled += (unsigned char)args[0];
+}
+
+#define STUB_ENTRY(key, handler) { key, stub },
+static constexpr CommandEntry table[] = { COMMAND_TABLE(STUB_ENTRY) };
+static constexpr size_t TABLE_COUNT = sizeof(table) / sizeof(table[0]);
+static_assert(commandTableSorted(table, TABLE_COUNT), "command table must be sorted and unique");
+
+// The pre-table processCommand(): the command arrived by value and was
+// tested against each prefix in source order.
+static const char *const legacyPrefixes[] = {
+  "CMD:CLEAR", "n2:", "IC:", "SC1:", "SC2:", "B1:", "B2:", "BRIGHT:", "SIZE:",
+  "SPEED:", "CELEB:", "TIMEOUT:", "DEEPSLEEP:", "Effect:", "ColorIndex:",
+  "brightness:", "CMD:SLEEP", "toggleLights", "toggleEspNow", "CMD:RESTART",
+  "CMD:SETTINGS", "CMD:INFO", "SET_ROLE:SECONDARY", "SET_ROLE:PRIMARY", "r2:",
+  "ACK:", "CMD:IDENTIFY:",
+};
+
+static bool legacyDispatch(std::string command) {
+  for (const char *prefix : legacyPrefixes) {
+    if (command.compare(0, strlen(prefix), prefix) == 0) {
+      stub(command.c_str() + strlen(prefix));
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool tableDispatch(const std::string &command) {
+  const char *args;
+  const CommandEntry *entry = parseCommand(table, TABLE_COUNT, command.c_str(), &args);
+  if (!entry) return false;
+  entry->handler(args);
+  return true;
+}
+
+// What the app sends, per 100 commands, from lib/: the home screen's
+// brightness slider sends on every drag step and dominates; effect and
+// colour taps come next; the setup screen's sliders and colours are sent
+// once per save; CMD:INFO and CMD:SETTINGS follow connects and refreshes.
+struct WeightedCommand {
+  const char *command;
+  int weight;
+};
+
+static const WeightedCommand appMix[] = {
+  { "brightness:128", 60 }, { "Effect:Rainbow", 10 }, { "ColorIndex:4", 10 },
+  { "BRIGHT:120", 3 }, { "SIZE:5", 3 }, { "SPEED:40", 3 },
+  { "SC1:255,0,0", 2 }, { "SC2:0,0,255", 2 }, { "CMD:INFO", 4 },
+  { "CMD:SETTINGS", 2 }, { "CMD:IDENTIFY:aa-bb-cc-dd-ee-ff", 1 },
+};
+
+// Worst case for the old chain: the last prefix it tested.
+static const WeightedCommand tailOfChain[] = {
+  { "CMD:IDENTIFY:aa-bb-cc-dd-ee-ff", 1 },
+};
+
+template <size_t N>
+static std::vector<std::string> expand(const WeightedCommand (&mix)[N]) {
+  std::vector<std::string> commands;
+  for (const WeightedCommand &w : mix) commands.insert(commands.end(), w.weight, w.command);
+  std::shuffle(commands.begin(), commands.end(), std::mt19937(1));
+  return commands;
+}
+
+template <typename F>
+static double nsPerCommand(F dispatch, const std::vector<std::string> &commands, int rounds) {
+  auto start = std::chrono::steady_clock::now();
+  for (int r = 0; r < rounds; r++) {
+    for (const std::string &c : commands) dispatch(c);
+  }
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  return std::chrono::duration<double, std::nano>(elapsed).count() / (rounds * (double)commands.size());
+}
+
+static void report(const char *label, const std::vector<std::string> &commands, int rounds) {
+  double legacy = nsPerCommand(legacyDispatch, commands, rounds);
+  double tabled = nsPerCommand(tableDispatch, commands, rounds);
+  printf("%s: if-chain %.1f ns/cmd, table %.1f ns/cmd (%.1fx)\n", label, legacy, tabled, legacy / tabled);
+}
+
+int main() {
+  // Every key must resolve to itself, with and without arguments.
+  for (const CommandEntry &e : table) {
+    const char *args;
+    std::string withArgs = std::string(e.key) + ":x";
+    if (parseCommand(table, TABLE_COUNT, e.key, &args) != &e || *args != '\0'
+        || parseCommand(table, TABLE_COUNT, withArgs.c_str(), &args) != &e || *args != 'x') {
+      fprintf(stderr, "FAIL: %s does not dispatch to itself\n", e.key);
+      return 1;
+    }
+  }
+
+  std::vector<std::string> mix = expand(appMix);
+  for (const std::string &c : mix) {
+    if (!tableDispatch(c)) {
+      fprintf(stderr, "FAIL: app command %s is not dispatched\n", c.c_str());
+      return 1;
+    }
+  }
+
+  printf("%zu commands\n", TABLE_COUNT);
+  report("app mix", mix, 30000);
+  report("worst case (tail of the old chain)", expand(tailOfChain), 2000000);
+  return 0;
+}
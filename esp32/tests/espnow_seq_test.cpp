@@ -0,0 +1,135 @@
+// ESP-NOW sequence numbers and the receiver's duplicate window.
+//  1. Two threads draw from one counter, as loop() and the comms task do;
+//     every value must be handed out exactly once.
+//  2. Those frames reach the receiver reordered and with retransmits mixed
+//     in; each original must be accepted once and each repeat dropped.
+//  3. Two senders interleave, and a sender reboots into a new session.
+#include <algorithm>
+#include <cstdio>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "espnow_seq.h"
+
+static int failures = 0;
+#define CHECK(cond, ...) \
+  do { \
+    if (!(cond)) { \
+      fprintf(stderr, "FAIL: " __VA_ARGS__); \
+      fputc('\n', stderr); \
+      failures++; \
+    } \
+  } while (0)
+
+static const uint8_t MAC_A[6] = { 0x24, 0x6f, 0x28, 0, 0, 0xa };
+static const uint8_t MAC_B[6] = { 0x24, 0x6f, 0x28, 0, 0, 0xb };
+
+struct Frame {
+  const uint8_t *mac;
+  uint8_t session;
+  uint16_t seq;
+  bool repeat;
+};
+
+static void twoSenderCounter(std::vector<uint16_t> &seqs) {
+  const int perThread = 30000;  // 2x stays under 65536, so no value may repeat
+  std::atomic<uint16_t> counter(0xfff0);  // Wraps during the run
+  std::vector<uint16_t> a, b;
+  auto send = [&counter](std::vector<uint16_t> &out) {
+    for (int i = 0; i < perThread; i++) out.push_back(nextSeq(counter));
+  };
+  std::thread t1(send, std::ref(a));
+  std::thread t2(send, std::ref(b));
+  t1.join();
+  t2.join();
+
+  seqs = a;
+  seqs.insert(seqs.end(), b.begin(), b.end());
+  std::vector<uint16_t> sorted = seqs;
+  std::sort(sorted.begin(), sorted.end());
+  CHECK(std::adjacent_find(sorted.begin(), sorted.end()) == sorted.end(), "two senders drew the same seq");
+  CHECK(counter.load() == (uint16_t)(0xfff0 + 2 * perThread), "counter lost increments");
+
+  // In send order the two streams interleave; ascending from the start value is that order.
+  std::sort(seqs.begin(), seqs.end(), [](uint16_t x, uint16_t y) {
+    return (uint16_t)(x - 0xfff0) < (uint16_t)(y - 0xfff0);
+  });
+}
+
+static void reorderedWithRepeats(const std::vector<uint16_t> &seqs) {
+  std::mt19937 rng(7);
+  std::vector<Frame> air;
+  for (uint16_t s : seqs) air.push_back({ MAC_A, 1, s, false });
+
+  // Shuffle within blocks of 8: the radio and retransmits reorder a little.
+  for (size_t i = 0; i + 8 <= air.size(); i += 8) std::shuffle(air.begin() + i, air.begin() + i + 8, rng);
+
+  // A retransmit shows up 1-20 frames after the original when the ACK was lost.
+  std::vector<Frame> withRepeats;
+  std::vector<std::pair<size_t, Frame>> late;
+  for (size_t i = 0; i < air.size(); i++) {
+    withRepeats.push_back(air[i]);
+    if (rng() % 7 == 0) late.push_back({ i + 1 + rng() % 20, { MAC_A, 1, air[i].seq, true } });
+    for (auto it = late.begin(); it != late.end();) {
+      if (it->first == i) {
+        withRepeats.push_back(it->second);
+        it = late.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  PeerSeqWindow windows[6] = {};
+  size_t accepted = 0, repeatsDropped = 0, repeats = 0;
+  unsigned long now = 0;
+  for (const Frame &f : withRepeats) {
+    bool dup = isDuplicateSeq(windows, 6, f.mac, f.session, f.seq, ++now);
+    if (f.repeat) {
+      repeats++;
+      if (dup) repeatsDropped++;
+      else CHECK(false, "retransmit of seq %u accepted twice", f.seq);
+    } else {
+      if (!dup) accepted++;
+      else CHECK(false, "original seq %u dropped as a duplicate", f.seq);
+    }
+  }
+  CHECK(accepted == seqs.size(), "accepted %zu of %zu frames", accepted, seqs.size());
+  printf("reorder: %zu frames accepted once, %zu/%zu retransmits dropped\n", accepted, repeatsDropped, repeats);
+}
+
+static void interleavedSendersAndReboot() {
+  PeerSeqWindow windows[6] = {};
+  unsigned long now = 0;
+
+  // Both boards happen to use the same seq values; windows are per MAC.
+  for (uint16_t s = 100; s < 200; s++) {
+    CHECK(!isDuplicateSeq(windows, 6, MAC_A, 3, s, ++now), "A seq %u dropped", s);
+    CHECK(!isDuplicateSeq(windows, 6, MAC_B, 9, s, ++now), "B seq %u dropped", s);
+  }
+  CHECK(isDuplicateSeq(windows, 6, MAC_A, 3, 199, ++now), "A repeat of 199 accepted");
+
+  // A reboots: new session, its counter restarts below the old window.
+  CHECK(!isDuplicateSeq(windows, 6, MAC_A, 4, 5, ++now), "A after reboot dropped");
+  CHECK(!isDuplicateSeq(windows, 6, MAC_A, 4, 6, ++now), "A after reboot dropped");
+  CHECK(isDuplicateSeq(windows, 6, MAC_A, 4, 5, ++now), "A repeat after reboot accepted");
+
+  // What the non-atomic counter did: two frames went out with one seq and
+  // the receiver dropped the second as a repeat. nextSeq() must prevent this.
+  CHECK(isDuplicateSeq(windows, 6, MAC_B, 9, 199, ++now), "shared seq not treated as a repeat");
+  printf("senders: per-MAC windows and session reset ok\n");
+}
+
+int main() {
+  std::vector<uint16_t> seqs;
+  twoSenderCounter(seqs);
+  printf("counter: %zu seqs from two threads, all distinct\n", seqs.size());
+  reorderedWithRepeats(seqs);
+  interleavedSendersAndReboot();
+  if (failures) {
+    fprintf(stderr, "%d failure(s)\n", failures);
+    return 1;
+  }
+  return 0;
+}
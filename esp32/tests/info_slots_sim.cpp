@@ -0,0 +1,157 @@
+// Multi-board simulation of a CMD:INFO refresh with the slots in
+// info_slots.h, against the earlier name/MAC slots. Each SECONDARY answers
+// in its slot after a few ms of loop() latency. Replies that overlap on air
+// are lost and retried by espNowSendReliable() after 20 ms << attempt, so
+// two boards in one slot keep colliding until they give up. That is
+// pessimistic, as the radio's carrier sense is not modelled. The figure is
+// the time until the PRIMARY holds every known board's reply.
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "info_slots.h"
+
+#define MAX_PEERS 6
+#define AIRTIME_MS 1.0     // One board-info frame plus its ACK
+#define LOOP_JITTER_MS 3.0  // deferAction() runs on the next loop() pass
+#define RETRY_BASE_MS 20
+#define MAX_ATTEMPTS 5
+
+struct Board {
+  uint8_t mac[6];
+  std::string name;
+};
+
+// The slots before this change: "Board N" in slot N-1, others by MAC.
+static int namedSlot(const Board &b) {
+  int number = b.name.rfind("Board ", 0) == 0 ? atoi(b.name.c_str() + 6) : 0;
+  if (number >= 2) return 1 + (number - 2) % MAX_PEERS;
+  return 1 + b.mac[5] % MAX_PEERS;
+}
+
+static int tableSlot(const Board &b, const char *list) {
+  return infoSlotFor(list, b.mac);
+}
+
+struct Result {
+  double ms;         // Until the last reply arrived, -1 if one never did
+  int sharedSlots;   // Boards answering in a slot another board also uses
+};
+
+template <typename SlotFn>
+static Result refresh(const std::vector<Board> &boards, SlotFn slotOf, std::mt19937 &rng) {
+  struct Tx {
+    double at;
+    int attempt;
+    size_t board;
+  };
+  std::vector<Tx> pending;
+  std::vector<int> slots;
+  for (size_t i = 0; i < boards.size(); i++) {
+    int slot = slotOf(boards[i]);
+    slots.push_back(slot);
+    pending.push_back({ slot * INFO_SLOT_MS + std::uniform_real_distribution<>(0, LOOP_JITTER_MS)(rng), 1, i });
+  }
+
+  Result r = { 0, 0 };
+  for (size_t i = 0; i < slots.size(); i++) r.sharedSlots += std::count(slots.begin(), slots.end(), slots[i]) > 1;
+
+  while (!pending.empty()) {
+    std::sort(pending.begin(), pending.end(), [](const Tx &a, const Tx &b) { return a.at < b.at; });
+    Tx tx = pending.front();
+    pending.erase(pending.begin());
+    bool collided = false;
+    for (Tx &other : pending) {
+      if (other.at - tx.at >= AIRTIME_MS) break;
+      collided = true;
+      if (other.attempt < MAX_ATTEMPTS) {
+        other.at += RETRY_BASE_MS << other.attempt;
+        other.attempt++;
+      } else {
+        other.at = 1e9;  // Gives up
+      }
+    }
+    if (tx.at >= 1e9) return { -1, r.sharedSlots };
+    if (!collided) {
+      r.ms = std::max(r.ms, tx.at + AIRTIME_MS);
+      continue;
+    }
+    if (tx.attempt >= MAX_ATTEMPTS) return { -1, r.sharedSlots };
+    tx.at += RETRY_BASE_MS << tx.attempt;
+    tx.attempt++;
+    pending.push_back(tx);
+  }
+  return r;
+}
+
+static int failures = 0;
+
+static void expect(bool ok, const char *scenario, const char *what) {
+  printf("%s %s: %s\n", ok ? "ok  " : "FAIL", scenario, what);
+  if (!ok) failures++;
+}
+
+int main() {
+  std::mt19937 rng(7);
+  const int runs = 2000;
+
+  for (int secondaries = 1; secondaries <= MAX_PEERS; secondaries++) {
+    double namedSum = 0, namedMax = 0, tableSum = 0, tableMax = 0;
+    int namedShared = 0, tableShared = 0, namedLost = 0, tableLost = 0;
+
+    for (int run = 0; run < runs; run++) {
+      std::vector<Board> boards(secondaries);
+      uint8_t peers[MAX_PEERS][6];
+      int numbers[MAX_PEERS] = { 2, 3, 4, 5, 6, 7 };
+      std::shuffle(numbers, numbers + MAX_PEERS, rng);
+      for (int i = 0; i < secondaries; i++) {
+        uint8_t mac[6] = { 0x24, 0x6f, 0x28, (uint8_t)rng(), (uint8_t)rng(), (uint8_t)rng() };
+        memcpy(boards[i].mac, mac, 6);
+        memcpy(peers[i], mac, 6);
+        // Numbered boards have distinct numbers; about half keep the default name
+        boards[i].name = rng() % 2 ? "Board " + std::to_string(numbers[i]) : "Cornhole";
+      }
+      std::shuffle(peers, peers + secondaries, rng);  // Peer table order is arbitrary
+      char list[MAX_PEERS * 13 + 1];
+      formatInfoSlots(list, sizeof(list), peers, secondaries);
+
+      Result named = refresh(boards, namedSlot, rng);
+      Result table = refresh(boards, [&](const Board &b) { return tableSlot(b, list); }, rng);
+      namedLost += named.ms < 0;
+      tableLost += table.ms < 0;
+      namedSum += std::max(0.0, named.ms);
+      tableSum += std::max(0.0, table.ms);
+      namedMax = std::max(namedMax, named.ms);
+      tableMax = std::max(tableMax, table.ms);
+      namedShared += named.sharedSlots > 0;
+      tableShared += table.sharedSlots > 0;
+    }
+
+    printf("%d secondaries: name/MAC slots mean %.1f ms max %.1f ms, shared slot in %d, reply lost in %d; "
+           "table slots mean %.1f ms max %.1f ms, shared slot in %d, reply lost in %d (of %d)\n",
+           secondaries, namedSum / std::max(1, runs - namedLost), namedMax, namedShared, namedLost,
+           tableSum / std::max(1, runs - tableLost), tableMax, tableShared, tableLost, runs);
+
+    char what[80];
+    snprintf(what, sizeof(what), "%d secondaries: no two boards share a slot", secondaries);
+    expect(tableShared == 0, "table slots", what);
+    snprintf(what, sizeof(what), "%d secondaries: full list within the last slot", secondaries);
+    expect(tableMax <= secondaries * INFO_SLOT_MS + LOOP_JITTER_MS + AIRTIME_MS, "table slots", what);
+    snprintf(what, sizeof(what), "%d secondaries: every reply arrives", secondaries);
+    expect(tableLost == 0, "table slots", what);
+  }
+
+  // A board missing from the list still answers, after the listed slots
+  uint8_t known[2][6] = { { 1, 2, 3, 4, 5, 6 }, { 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff } };
+  uint8_t stranger[6] = { 9, 9, 9, 9, 9, 9 };
+  char list[32];
+  formatInfoSlots(list, sizeof(list), known, 2);
+  expect(infoSlotFor(list, known[0]) == 1 && infoSlotFor(list, known[1]) == 2, "slot list", "listed boards in order");
+  int late = infoSlotFor(list, stranger);
+  expect(late > 2 && late <= 2 + INFO_UNLISTED_SLOTS, "slot list", "unlisted board after the listed slots");
+  expect(infoSlotFor("", stranger) >= 1, "slot list", "request without a list still gets a slot");
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,199 @@
+// Multi-board simulation of the role election in role_election.h.
+// Boards share a lossy broadcast channel with a few ms of latency and run
+// the same steps as the sketch: announce at boot, record claims (answering
+// new or rebooted senders), decide in loop() and re-announce periodically.
+#include <cstdio>
+#include <deque>
+#include <random>
+#include <vector>
+
+#include "role_election.h"
+
+#define MAX_CLAIMS 6
+#define STEP_MS 10
+
+struct Board {
+  uint8_t mac[6];
+  bool primary;
+  bool on;
+  uint8_t session;
+  unsigned long electionStart;
+  unsigned long lastAnnounce;
+  int roleChanges;
+  RoleClaim claims[MAX_CLAIMS];
+};
+
+struct Frame {
+  size_t from;
+  bool primary;
+  uint8_t session;
+  unsigned long deliverAt;
+};
+
+struct Sim {
+  std::vector<Board> boards;
+  std::deque<Frame> air;
+  unsigned long now = 0;
+  double loss = 0;
+  std::mt19937 rng{ 42 };
+
+  size_t add(uint8_t id, bool primary) {
+    Board b = {};
+    uint8_t mac[6] = { 0x24, 0x6f, 0x28, 0x10, 0x20, id };
+    memcpy(b.mac, mac, 6);
+    b.primary = primary;
+    boards.push_back(b);
+    return boards.size() - 1;
+  }
+
+  void announce(size_t i) {
+    boards[i].lastAnnounce = now;
+    air.push_back({ i, boards[i].primary, boards[i].session, now + 1 + rng() % 5 });
+  }
+
+  void boot(size_t i) {
+    Board &b = boards[i];
+    b.on = true;
+    b.session = (uint8_t)rng();
+    b.electionStart = now;
+    memset(b.claims, 0, sizeof(b.claims));
+    announce(i);
+  }
+
+  void run(unsigned long ms) {
+    for (unsigned long end = now + ms; now < end; now += STEP_MS) {
+      std::deque<Frame> due;
+      for (auto it = air.begin(); it != air.end();) {
+        if (it->deliverAt <= now) {
+          due.push_back(*it);
+          it = air.erase(it);
+        } else {
+          ++it;
+        }
+      }
+      for (const Frame &f : due) {
+        for (size_t i = 0; i < boards.size(); i++) {
+          if (i == f.from || !boards[i].on || std::uniform_real_distribution<>(0, 1)(rng) < loss) continue;
+          if (recordRoleClaim(boards[i].claims, MAX_CLAIMS, boards[f.from].mac, f.primary, f.session, now)) announce(i);
+        }
+      }
+      for (size_t i = 0; i < boards.size(); i++) {
+        Board &b = boards[i];
+        if (!b.on) continue;
+        RoleDecision d = decideRole(b.claims, MAX_CLAIMS, b.mac, b.primary, b.electionStart, now);
+        if (d != ROLE_KEEP) {
+          b.primary = d == ROLE_PROMOTE;
+          b.roleChanges++;
+          announce(i);
+        } else if (now - b.lastAnnounce >= ROLE_REANNOUNCE_MS) {
+          announce(i);
+        }
+      }
+    }
+  }
+
+  int primaries() const {
+    int n = 0;
+    for (const Board &b : boards) n += b.on && b.primary;
+    return n;
+  }
+};
+
+static int failures = 0;
+
+static void expect(bool ok, const char *scenario, const char *what) {
+  printf("%s %s: %s\n", ok ? "ok  " : "FAIL", scenario, what);
+  if (!ok) failures++;
+}
+
+static void coldStartAllSecondary() {
+  Sim sim;
+  for (uint8_t id : { 0x30, 0x10, 0x50, 0x20 }) sim.add(id, false);
+  for (size_t i = 0; i < sim.boards.size(); i++) sim.boot(i);
+  sim.run(3000);
+  expect(sim.primaries() == 1 && sim.boards[1].primary, "cold start", "lowest MAC is the only PRIMARY");
+}
+
+static void splitBrain() {
+  Sim sim;
+  sim.add(0x40, true);
+  sim.add(0x20, true);
+  sim.add(0x30, false);
+  for (size_t i = 0; i < sim.boards.size(); i++) sim.boot(i);
+  sim.run(3000);
+  expect(sim.primaries() == 1 && sim.boards[1].primary, "split brain", "lower of two PRIMARYs keeps the role");
+  sim.run(60000);
+  expect(sim.boards[1].roleChanges == 0 && sim.boards[2].roleChanges == 0, "split brain", "stable for a minute after");
+}
+
+static void lateJoiner() {
+  Sim sim;
+  sim.add(0x40, true);
+  sim.add(0x50, false);
+  sim.boot(0);
+  sim.boot(1);
+  sim.run(20000);
+
+  size_t low = sim.add(0x10, false);  // Lowest MAC, saved SECONDARY: must not take over
+  sim.boot(low);
+  sim.run(20000);
+  expect(sim.primaries() == 1 && sim.boards[0].primary && sim.boards[low].roleChanges == 0, "late joiner",
+         "low-MAC SECONDARY hears the PRIMARY before its window closes");
+
+  size_t high = sim.add(0x60, true);  // Saved PRIMARY from another game
+  sim.boot(high);
+  sim.run(3000);
+  expect(sim.primaries() == 1 && !sim.boards[high].primary, "late joiner", "higher-MAC PRIMARY steps down");
+}
+
+static void primaryVanishes() {
+  Sim sim;
+  sim.add(0x10, true);
+  sim.add(0x30, false);
+  sim.add(0x20, false);
+  for (size_t i = 0; i < sim.boards.size(); i++) sim.boot(i);
+  sim.run(20000);
+  sim.boards[0].on = false;
+  sim.run(ROLE_CLAIM_TTL_MS + ROLE_REANNOUNCE_MS);
+  expect(sim.primaries() == 1 && sim.boards[2].primary, "PRIMARY off", "lowest remaining board promotes");
+}
+
+static void quickReboot() {
+  Sim sim;
+  sim.add(0x40, true);
+  sim.add(0x10, false);  // Lower MAC than the PRIMARY
+  sim.boot(0);
+  sim.boot(1);
+  sim.run(20000);
+  sim.boot(1);  // Back within a second; its old claim is still live on the PRIMARY
+  sim.run(20000);
+  expect(sim.primaries() == 1 && sim.boards[0].primary && sim.boards[1].roleChanges == 0, "quick reboot",
+         "rebooted SECONDARY is answered and stays SECONDARY");
+}
+
+static void lossyChannel() {
+  int converged = 0;
+  const int runs = 50;
+  for (int r = 0; r < runs; r++) {
+    Sim sim;
+    sim.rng.seed(r);
+    sim.loss = 0.1;
+    for (uint8_t id : { 0x60, 0x50, 0x40, 0x30, 0x20 }) sim.add(id, r % 2 == 0);
+    for (size_t i = 0; i < sim.boards.size(); i++) sim.boot(i);
+    sim.run(60000);
+    converged += sim.primaries() == 1;
+  }
+  char what[80];
+  snprintf(what, sizeof(what), "exactly one PRIMARY in %d/%d runs at 10%% loss", converged, runs);
+  expect(converged == runs, "lossy channel", what);
+}
+
+int main() {
+  coldStartAllSecondary();
+  splitBrain();
+  lateJoiner();
+  primaryVanishes();
+  quickReboot();
+  lossyChannel();
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,119 @@
+#!/usr/bin/env python3
+"""Build a CDP1 delta patch for the cornhole board OTA.
+
+usage: make_delta.py BASE.bin NEW.bin PATCH.cdp
+
+BASE.bin must be the exact image the boards are running. The patch format
+is documented next to otaApplyPatch() in cornhole_LEDs.ino. The app sends
+the patch deflated when that is smaller, so runs of zero diff bytes cost
+next to nothing on the air.
+
+Prints the manifest entry for updates/cornhole_board_version.json; the
+base_elf_sha256 is what the board checks against its running firmware
+before it accepts the patch.
+"""
+import json
+import os
+import struct
+import sys
+import zlib
+
+BLOCK = 32                 # Seed length for a copy from the base image
+ALIGN = 4                  # Base offsets indexed; ESP32 code moves in words
+APP_ELF_SHA_OFFSET = 0xB0  # esp_app_desc_t.app_elf_sha256, after the 0x20 image headers
+GIVE_UP = 64               # Stop extending after this many bytes without gain
+
+
+def index_base(base):
+    index = {}
+    for i in range(0, len(base) - BLOCK + 1, ALIGN):
+        index.setdefault(base[i:i + BLOCK], i)
+    return index
+
+
+def extend(base, new, b, n):
+    """bsdiff-style forward extension: keep the prefix where matches
+    outnumber mismatches the most, so small edits ride along as diffs."""
+    limit = min(len(base) - b, len(new) - n)
+    matches = best_matches = best_len = 0
+    i = 0
+    while i < limit:
+        if base[b + i] == new[n + i]:
+            matches += 1
+        i += 1
+        if matches * 2 - i > best_matches * 2 - best_len:
+            best_matches, best_len = matches, i
+        elif i - best_len > GIVE_UP:
+            break
+    return best_len
+
+
+def make_patch(base, new):
+    index = index_base(base)
+    out = bytearray(b"CDP1")
+    literal = bytearray()
+    copied = 0
+
+    def flush_literal():
+        if literal:
+            out.extend(b"I" + struct.pack("<I", len(literal)) + literal)
+            literal.clear()
+
+    n = 0
+    while n < len(new):
+        b = index.get(bytes(new[n:n + BLOCK])) if n + BLOCK <= len(new) else None
+        if b is None:
+            literal.append(new[n])
+            n += 1
+            continue
+        length = extend(base, new, b, n)
+        flush_literal()
+        diff = bytes((new[n + i] - base[b + i]) & 0xFF for i in range(length))
+        out.extend(b"A" + struct.pack("<II", b, length) + diff)
+        copied += length
+        n += length
+    flush_literal()
+    return bytes(out), copied
+
+
+def apply_patch(base, patch):
+    assert patch[:4] == b"CDP1"
+    out = bytearray()
+    pos = 4
+    while pos < len(patch):
+        op = patch[pos:pos + 1]
+        if op == b"A":
+            src, length = struct.unpack_from("<II", patch, pos + 1)
+            pos += 9
+            out.extend((base[src + i] + patch[pos + i]) & 0xFF for i in range(length))
+        else:
+            (length,) = struct.unpack_from("<I", patch, pos + 1)
+            pos += 5
+            out.extend(patch[pos:pos + length])
+        pos += length
+    return bytes(out)
+
+
+def main():
+    if len(sys.argv) != 4:
+        sys.exit(__doc__)
+    base = open(sys.argv[1], "rb").read()
+    new = open(sys.argv[2], "rb").read()
+
+    patch, copied = make_patch(base, new)
+    if apply_patch(base, patch) != new:
+        sys.exit("patch does not reproduce NEW.bin")
+    open(sys.argv[3], "wb").write(patch)
+
+    deflated = len(zlib.compress(patch, 9)) - 6  # raw deflate, as the app sends it
+    print("image %d bytes, %d copied from base" % (len(new), copied))
+    print("patch %d bytes, ~%d deflated (%.1f%% of image)" % (len(patch), deflated, deflated * 100.0 / len(new)))
+    print(json.dumps({
+        "base": "<base version>",
+        "base_elf_sha256": base[APP_ELF_SHA_OFFSET:APP_ELF_SHA_OFFSET + 32].hex(),
+        "file": os.path.basename(sys.argv[3]),
+    }, indent=2))
+
+
+if __name__ == "__main__":
+    main()
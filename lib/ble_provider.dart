@@ -161,6 +161,29 @@ class BLEProvider with ChangeNotifier {
     }
   }
 
+  // OTA session state, e.g. {active: 1, stream: 3, offset: 40960, ...}
+  Future<Map<String, String>?> readOtaStatus() async {
+    if (otaCharacteristic == null) {
+      logger.w("❌ otaCharacteristic is null");
+      return null;
+    }
+
+    try {
+      final raw = utf8.decode(await otaCharacteristic!.read());
+      logger.i("📦 OTA status read: $raw");
+      if (!raw.startsWith("OTA:")) return null;
+      final status = <String, String>{};
+      for (final pair in raw.substring(4).replaceAll(";", "").split(",")) {
+        final kv = pair.split("=");
+        if (kv.length == 2) status[kv[0]] = kv[1];
+      }
+      return status;
+    } catch (e) {
+      logger.e("❌ Failed to read OTA status: $e");
+      return null;
+    }
+  }
+
   BLEProvider() {
     initializeBluetooth();
     if (isConnected) {
@@ -378,6 +401,31 @@ class BLEProvider with ChangeNotifier {
       final completeField = receivedMessage.substring(0, endIndex);
       receivedMessage = receivedMessage.substring(endIndex + 1);
 
+      // OTA flow control is time critical, don't wait for a board block
+      if (completeField.startsWith("OTA_CREDIT:")) {
+        final parts = completeField.substring(11).split(",");
+        final stream = int.tryParse(parts.first);
+        final credits = parts.length == 2 ? int.tryParse(parts[1]) : null;
+        if (stream != null && credits != null) {
+          otaScreenKey.currentState?.onOtaCredit(stream, credits);
+        }
+        continue;
+      }
+      if (completeField.startsWith("OTA_ERROR:")) {
+        final stream = int.tryParse(completeField.substring(10));
+        if (stream != null) otaScreenKey.currentState?.onOtaError(stream);
+        continue;
+      }
+      if (completeField.startsWith("RELAY:")) {
+        final parts = completeField.substring(6).split(",");
+        final percent = int.tryParse(parts.first);
+        final boards = parts.length == 2 ? int.tryParse(parts[1]) : null;
+        if (percent != null && boards != null) {
+          otaScreenKey.currentState?.onRelayProgress(percent, boards);
+        }
+        continue;
+      }
+
       // Accumulate into notification string
       accumulatedNotification += "$completeField;";
 
@@ -1,5 +1,8 @@
 // ota_screen.dart
 import 'package:http/http.dart' as http;
+import 'package:crypto/crypto.dart';
+import 'dart:async';
+import 'dart:io' show ZLibEncoder;
 import 'dart:math';
 import 'dart:convert';
 import 'package:flutter/material.dart';
@@ -12,20 +15,54 @@ import '/widgets/background.dart';
 import '/widgets/section.dart';
 import '/widgets/status_indicators.dart';
 
+// A delta from one released version to the current one, built with
+// esp32/tools/make_delta.py
+class Patch {
+  final String base;
+  final String baseElfSha256;
+  final String file;
+
+  const Patch(
+      {required this.base, required this.baseElfSha256, required this.file});
+
+  factory Patch.fromJson(Map<String, dynamic> json) {
+    return Patch(
+      base: json['base'] ?? '',
+      baseElfSha256: json['base_elf_sha256'] ?? '',
+      file: json['file'] ?? '',
+    );
+  }
+}
+
 class Update {
   final String url;
   final String bin;
   final String version;
+  final List<Patch> patches;
 
-  const Update({required this.url, required this.bin, required this.version});
+  const Update(
+      {required this.url,
+      required this.bin,
+      required this.version,
+      this.patches = const []});
 
   factory Update.fromJson(Map<String, dynamic> json) {
     return Update(
       url: json['file_url'] ?? '',
       bin: json['bin'] ?? '',
       version: json['version'] ?? '',
+      patches: (json['patches'] as List<dynamic>? ?? [])
+          .map((p) => Patch.fromJson(p as Map<String, dynamic>))
+          .toList(),
     );
   }
+
+  Patch? patchFrom(String boardVersion) {
+    for (final patch in patches) {
+      if (patch.base == boardVersion) return patch;
+    }
+    return null;
+  }
 }
 
 class OTAScreen extends StatefulWidget {
@@ -49,6 +86,14 @@ class OTAScreenState extends State<OTAScreen>
   List<String> logs = [];
   final ScrollController _scrollController = ScrollController();
 
+  // Chunks the board will accept since BEGIN/RESUME (one per free flash
+  // buffer); grants for any other stream are stale
+  int _otaStream = 0;
+  int _otaCredits = 0;
+  bool _otaFailed = false;
+  Completer<void>? _creditWaiter;
+  static const creditTimeout = Duration(seconds: 3);
+
   BLEProvider get bleProvider =>
       Provider.of<BLEProvider>(context, listen: false);
 
@@ -135,6 +180,46 @@ class OTAScreenState extends State<OTAScreen>
     });
   }
 
+  void onOtaCredit(int stream, int total) {
+    if (stream != _otaStream || total <= _otaCredits) return;
+    _otaCredits = total;
+    _creditWaiter?.complete();
+    _creditWaiter = null;
+  }
+
+  // The board's writer failed; its log line says why
+  void onOtaError(int stream) {
+    if (stream != _otaStream) return;
+    _otaFailed = true;
+    _creditWaiter?.complete();
+    _creditWaiter = null;
+  }
+
+  Future<void> _waitForCredit(int sent) async {
+    while (sent >= _otaCredits) {
+      if (_otaFailed) throw Exception("Board aborted the OTA");
+      _creditWaiter ??= Completer<void>();
+      await _creditWaiter!.future.timeout(creditTimeout,
+          onTimeout: () =>
+              throw Exception("Board stopped granting OTA credits"));
+    }
+  }
+
+  // RELAY:<percent>,<boards>; from the PRIMARY while it updates the others
+  void onRelayProgress(int percent, int boards) {
+    setState(() {
+      progress = percent / 100;
+      _isUpdating = percent < 100 && boards > 0;
+    });
+  }
+
+  // SECONDARY boards not reporting the update's version (empty = unknown)
+  List<BoardInfo> outdatedSecondaries(List<BoardInfo> boards) {
+    return boards
+        .where((b) => b.role != "PRIMARY" && b.version != update!.version)
+        .toList();
+  }
+
   void handleOtaStatusUpdate(String status) {
     logMessage(status);
     if (status.contains("Finished") ||
@@ -163,7 +248,7 @@ class OTAScreenState extends State<OTAScreen>
   }
 
   Future<void> performOta(String url,
-      {void Function(double percent)? onProgress}) async {
+      {Patch? patch, void Function(double percent)? onProgress}) async {
     if (bleProvider.otaCharacteristic == null) {
       logger.e("No OTA characteristic in discoverServices!");
       return;
@@ -179,25 +264,93 @@ class OTAScreenState extends State<OTAScreen>
     final total = firmware.length;
     logger.i("📥 Downloaded $total bytes for OTA");
 
-    // 2) signal BEGIN
-    await bleProvider.otaCharacteristic!.write(utf8.encode("BEGIN:$total"));
+    // A patch against the running firmware replaces the image on the air;
+    // the full image is still needed for its size and digest
+    List<int> source = firmware;
+    String baseField = "";
+    if (patch != null) {
+      final patchResp =
+          await http.get(Uri.parse("${update!.url}${patch.file}"));
+      if (patchResp.statusCode == 200) {
+        source = patchResp.bodyBytes;
+        baseField = ":${patch.baseElfSha256}";
+        logMessage(
+            "🧬 Delta from ${patch.base}: ${source.length} byte patch");
+      } else {
+        logMessage("⚠️ Patch unavailable, sending the full image");
+      }
+    }
+
+    // BLE is the bottleneck, so send a raw deflate stream when it is
+    // smaller; the board inflates it on the fly. Level 9 output is
+    // deterministic, so a resumed session gets the same bytes.
+    final deflated = ZLibEncoder(raw: true, level: 9).convert(source);
+    final useDeflate = deflated.length < source.length;
+    final encoding = useDeflate ? "deflate" : "raw";
+    final payload = useDeflate ? deflated : source;
+    final streamLen = payload.length;
+    if (useDeflate || baseField.isNotEmpty) {
+      logMessage(
+          "🗜️ Sending $streamLen of $total bytes (${(streamLen * 100 / total).toStringAsFixed(0)}%)");
+    }
 
-    // 3) chunk & write
+    // 2) resume a session the board still holds for this image, otherwise
+    //    signal BEGIN with the image digest. Either way the board answers
+    //    with the first credits of a new stream.
+    final digest = sha256.convert(firmware);
+    final status = await bleProvider.readOtaStatus();
+    if (status == null) throw Exception("Cannot read OTA status from board");
+    int offset = 0;
+    _otaStream = (int.tryParse(status['stream'] ?? '') ?? 0) + 1;
+    _otaCredits = 0;
+    _otaFailed = false;
+    final stopwatch = Stopwatch()..start();
+    if (status['active'] == '1' &&
+        status['sha'] == digest.toString() &&
+        status['size'] == '$total' &&
+        status['enc'] == encoding &&
+        status['delta'] == (baseField.isEmpty ? '0' : '1')) {
+      offset = int.parse(status['offset']!);
+      logMessage("🔁 Resuming OTA at $offset of $streamLen bytes");
+      await bleProvider.otaCharacteristic!
+          .write(utf8.encode("RESUME:$offset:$digest"));
+    } else {
+      if (status['active'] == '1') {
+        await bleProvider.otaCharacteristic!.write(utf8.encode("ABORT"));
+        await Future.delayed(const Duration(milliseconds: 200)); // drain
+      }
+      await bleProvider.otaCharacteristic!
+          .write(utf8.encode("BEGIN:$total:$digest:$encoding$baseField"));
+    }
+    final startOffset = offset;
+
+    // 3) chunk & write without response, as far as the credits allow
     final chunkSize = max(
         (bleProvider.negotiatedMtu > 3 ? bleProvider.negotiatedMtu - 3 : 20),
         128);
-    int offset = 0;
-    while (offset < total) {
-      final end = min(offset + chunkSize, total);
-      final chunk = firmware.sublist(offset, end);
-      await bleProvider.otaCharacteristic!.write(chunk, withoutResponse: false);
+    int sent = 0;
+    while (offset < streamLen) {
+      await _waitForCredit(sent);
+      final end = min(offset + chunkSize, streamLen);
+      final chunk = payload.sublist(offset, end);
+      await bleProvider.otaCharacteristic!.write(chunk, withoutResponse: true);
+      sent++;
       offset = end;
-      onProgress?.call(offset / total);
-      await Future.delayed(const Duration(milliseconds: 20)); // pacing
+      onProgress?.call(offset / streamLen);
     }
 
     // 4) finish
     await bleProvider.otaCharacteristic!.write(utf8.encode("END"));
+    stopwatch.stop();
+    final seconds = stopwatch.elapsedMilliseconds / 1000;
+    final kbPerSec = (streamLen - startOffset) / 1024 / seconds;
+    logMessage(
+        "📊 Sent ${streamLen - startOffset} bytes in ${seconds.toStringAsFixed(1)} s (${kbPerSec.toStringAsFixed(1)} KB/s)");
+    if (streamLen < total && startOffset == 0) {
+      // At the same link rate the raw image would have taken this long
+      logMessage(
+          "📊 Raw would take ~${(seconds * total / streamLen).toStringAsFixed(1)} s");
+    }
     logger.i("✅ OTA upload finished");
   }
 
@@ -322,30 +475,29 @@ class OTAScreenState extends State<OTAScreen>
 
                             await performOta(
                               fullUrl,
+                              patch: update!.patchFrom(boardVer),
                               onProgress: (p) => setState(() => progress = p),
                             );
 
                             logMessage("✅ OTA upload done");
 
-                            // Post OTA: Check if any secondary boards exist
-                            final boards = bleProvider.boards;
-                            final outdatedBoards = boards
-                                .where((b) => b.version != update!.version)
-                                .toList();
-
-                            if (outdatedBoards.isNotEmpty) {
+                            // Post OTA: the other boards report their own
+                            // version; an empty one (older firmware) counts
+                            // as outdated, the relay skips boards that match
+                            if (outdatedSecondaries(bleProvider.boards)
+                                .isNotEmpty) {
                               logMessage(
-                                  "🔁 Flipping roles to update ${outdatedBoards.first.name}...");
-                              await bleProvider
-                                  .sendCommand("SET_ROLE:SECONDARY;");
-                              await Future.delayed(const Duration(seconds: 6));
-                              bleProvider.disconnectDevice();
-                              await Future.delayed(const Duration(seconds: 3));
-                              bleProvider.scanForDevices(
-                                  rescan: true); // Reconnect
+                                  "🔁 After the board restarts, run Start OTA again to relay the update to the other boards.");
                             } else {
                               logMessage("🟢 No other boards to update.");
                             }
+                          } else if (outdatedSecondaries(bleProvider.boards)
+                              .isNotEmpty) {
+                            // This board is current: it streams its own
+                            // image to the others over ESP-NOW
+                            logMessage(
+                                "📡 Relaying the update to the other boards...");
+                            await bleProvider.sendCommand("CMD:RELAY;");
                           } else {
                             logMessage(
                                 "🟢 No update needed. Already on latest version.");